@@ -40,7 +40,7 @@ const hw_t hwt4 = {"PCAN-Micromod", "PCAN_MicroMod",
 		   flashid4};
 
 const hw_t hwt16 = {"PCAN-Router", "PCAN-Router",
-		   (FDATA_INVERT | DATA_MODE8),
+		   (FDATA_INVERT | DATA_MODE8 | BLANK_CHECK),
 		   0x03DF00, /* CRC start */
 		   0, /* flash offset */
 		   0, /* file skip */
@@ -70,7 +70,8 @@ const hw_t hwt21 = {"MU-Thermocouple1 CAN", "PCAN-MU",
 		   unknownflashid};
 
 const hw_t hwt25 = {"PCAN-Router Pro", "PCAN-Router_Pro",
-		   (FDATA_INVERT | DATA_MODE8 | SWITCH_TO_BOOTLOADER | RESET_AFTER_FLASH),
+		   (FDATA_INVERT | DATA_MODE8 | SWITCH_TO_BOOTLOADER | RESET_AFTER_FLASH |
+		    BLANK_CHECK),
 		   0x03DF00, /* CRC start */
 		   0, /* flash offset */
 		   0, /* file skip */
@@ -90,7 +91,7 @@ const hw_t hwt31 = {"PCAN-RS-232", "PCAN-RS-232",
 		   flashid12};
 
 const hw_t hwt35 = {"PCAN-Router DR", "PCAN-Router-DR",
-		   (FDATA_INVERT | DATA_MODE8),
+		   (FDATA_INVERT | DATA_MODE8 | BLANK_CHECK),
 		   0x03DF00, /* CRC start */
 		   0, /* flash offset */
 		   0, /* file skip */
@@ -110,7 +111,7 @@ const hw_t hwt37 = {"PCAN-GPS", "PCAN-GPS",
 		   unknownflashid};
 
 const hw_t hwt40 = {"PCAN-Router FD", "PCAN-Router_FD",
-		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING),
+		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING | BLANK_CHECK),
 		   0, /* CRC start */
 		   0, /* flash offset */
 		   0, /* file skip */
@@ -120,7 +121,7 @@ const hw_t hwt40 = {"PCAN-Router FD", "PCAN-Router_FD",
 		   flashid40};
 
 const hw_t hwt42 = {"PCAN-Router Pro FD", "PCAN-Router_Pro_FD",
-		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING),
+		   (FDATA_INVERT | DATA_MODE8 | END_PROGRAMMING | BLANK_CHECK),
 		   0, /* CRC start */
 		   0, /* flash offset */
 		   0, /* file skip */
@@ -32,10 +32,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sched.h>
 
-#include <net/if.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
+#include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <linux/can.h>
@@ -44,48 +44,109 @@
 #include "pcanflash.h"
 #include "pcanfunc.h"
 #include "pcanhw.h"
+#include "pcaninv.h"
+#include "pcanio.h"
+#include "pcanjrnl.h"
+#include "pcanrt.h"
+#include "pcansched.h"
+#include "pcansess.h"
+#include "pcanwork.h"
 
-#define PCF_MIN_TX_QUEUE 500
 #define BUFSZ 512 /* max. known block size */
+#define MAX_FILE_BLOCKS (0x1000000 / MIN_XFER_SIZE) /* 16 MB binary file */
+
+#define READY_TIMEOUT_MS 5000 /* max. wait for the bootloader */
+#define BLOCK_RETRIES 2 /* default retries of a failed block transfer */
 
 extern int optind, opterr, optopt;
 
 void print_usage(char *prg)
 {
-	fprintf(stderr, "\nUsage: %s <options> <interface>\n\n", prg);
+	fprintf(stderr, "\nUsage: %s <options> <interface> [<interface> ...]\n\n", prg);
 	fprintf(stderr, "Options: -f <file.bin>  (binary file to flash)\n");
 	fprintf(stderr, "         -i <module_id> (skip question when discovering multiple ids)\n");
+	fprintf(stderr, "         -m <id,id,..>  (multicast flashing of modules with the same hardware)\n");
+	fprintf(stderr, "         -F <id>:<file> (flash another image into this module at the same time)\n");
 	fprintf(stderr, "         -q             (just query modules and quit)\n");
+	fprintf(stderr, "         -I             (JSON inventory of the modules on all given or all CAN interfaces)\n");
+	fprintf(stderr, "         -P <count>     (profile status request round trips and quit)\n");
 	fprintf(stderr, "         -r             (reset module after flashing/query)\n");
 	fprintf(stderr, "         -R             (reset all modules after flashing/query)\n");
 	fprintf(stderr, "         -d             (dry run - skip erase/write commands)\n");
+	fprintf(stderr, "         -p             (pipelined handshake with less status requests)\n");
+	fprintf(stderr, "         -S             (verify per flash sector instead of per block)\n");
+	fprintf(stderr, "         -k             (keep unchanged flash sectors and blocks)\n");
+	fprintf(stderr, "         -n <retries>   (retries per flash block, default %d)\n",
+		BLOCK_RETRIES);
+	fprintf(stderr, "         -j <dir>       (resume journal directory)\n");
+	fprintf(stderr, "         -N <count>     (end the module query when count modules answered)\n");
+	fprintf(stderr, "         -Q <ms>        (idle window of the module query after a reply)\n");
+	fprintf(stderr, "         -t <ms>        (max. wait for the bootloader, default %d ms)\n",
+		READY_TIMEOUT_MS);
+	fprintf(stderr, "         -w <frames>    (max. unconfirmed data frames on the bus)\n");
+	fprintf(stderr, "         -l <percent>   (limit the bus load of the data transfer)\n");
+	fprintf(stderr, "         -T <backend>   (transmit backend: raw, bcm, ring, uring)\n");
+	fprintf(stderr, "         -s <prio>      (real-time mode with SCHED_FIFO priority)\n");
+	fprintf(stderr, "         -c <cpu>       (real-time mode pinned to cpu)\n");
+	fprintf(stderr, "\nSeveral interfaces are flashed at the same time by one worker per interface.\n");
 	fprintf(stderr, "\n");
 }
 
 int main(int argc, char **argv)
 {
 	static uint8_t buf[BUFSZ+2];
-	struct ifreq ifr;
-	struct sockaddr_can addr;
+	static uint8_t blkmap[MAX_FILE_BLOCKS];
 	static struct can_frame modules[MAX_MODULES];
-	struct can_filter rfilter;
-	int s; /* CAN_RAW socket */
+	canio_t io; /* CAN_RAW socket and tx properties */
 	static FILE *infile;
 	static int query;
+	static int inventory;
+	static int profile;
 	static int do_reset;
 	static int do_reset_all;
 	static int dry_run;
+	static int sess_flags;
+	static int verify_sectors;
+	static int keep_unchanged;
+	static int block_retries = BLOCK_RETRIES;
+	static char *jrnl_dir;
+	static int ready_ms = READY_TIMEOUT_MS;
+	static int expected; /* number of modules answering the query */
+	static int idle_ms; /* idle window of the module query */
+	static int tx_window;
+	static int bus_load;
+	static int backend = CANIO_RAW;
+	static int rt_prio;
+	int rt_cpu = RT_NO_CPU;
 	int module_id = NO_MODULE_ID;
-	int alternating_xor_flip;
+	static int group[MAX_MODULES]; /* module ids for multicast flashing */
+	static int members;
+	static flash_t fl[MAX_MODULES]; /* flashing process of the selected modules */
+	static FILE *files[MAX_MODULES]; /* images of the scheduled modules */
+	static job_t jobs[MAX_MODULES];
+	static work_t work[MAX_WORKERS]; /* workers of the CAN interfaces */
+	char *tok;
+	int m, left, rewrite;
+	jrnl_t jr; /* resume journal */
+	int resume = 0;
+	unsigned long resumed = 0;
+	unsigned long kept = 0;
+	struct can_frame cf;
 	uint32_t crc_start;
 	uint32_t floffset;
 	uint32_t blksz;
-	int opt, i;
+	const fblock_t *fblock;
+	int sector, strict_sector;
+	long sector_foffset = 0;
+	uint32_t sector_written = 0;
+	uint16_t sector_csum = 0;
+	int sector_programmed = 0;
+	int opt, i, eof, flags, skip;
 	uint8_t hw_type = 0;
 	long foffset;
 	int entries;
 
-	while ((opt = getopt(argc, argv, "f:i:qRrd?")) != -1) {
+	while ((opt = getopt(argc, argv, "f:i:m:F:qIP:RrdpSkn:j:N:Q:t:w:l:T:s:c:?")) != -1) {
 		switch (opt) {
 		case 'f':
 			infile = fopen(optarg, "r");
@@ -107,10 +168,52 @@ int main(int argc, char **argv)
 			module_id = strtoul(optarg, NULL, 10);
 			break;
 
+		case 'm':
+			if (files[0]) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				if (members == MAX_MODULES) {
+					fprintf(stderr, "too many module ids!\n");
+					return 1;
+				}
+				group[members++] = strtoul(tok, NULL, 10) & MAX_MODULES_MASK;
+			}
+			module_id = group[0];
+			break;
+
+		case 'F':
+			tok = strchr(optarg, ':');
+			if (!tok || (members == MAX_MODULES) || (members && !files[0])) {
+				print_usage(basename(argv[0]));
+				return 1;
+			}
+			files[members] = fopen(tok + 1, "r");
+			if (!files[members]) {
+				perror("infile");
+				return 1;
+			}
+			group[members++] = strtoul(optarg, NULL, 10) & MAX_MODULES_MASK;
+			module_id = group[0];
+			break;
+
 		case 'q':
 			query = 1;
 			break;
 
+		case 'I':
+			inventory = 1;
+			break;
+
+		case 'P':
+			profile = strtoul(optarg, NULL, 10);
+			if (profile < 1) {
+				fprintf(stderr, "profiling needs at least one status request!\n");
+				return 1;
+			}
+			break;
+
 		case 'R':
 			do_reset_all = 1;
 			/* fallthrough */
@@ -122,6 +225,90 @@ int main(int argc, char **argv)
 			dry_run = 1;
 			break;
 
+		case 'p':
+			sess_flags |= SESS_PIPELINE;
+			break;
+
+		case 'S':
+			verify_sectors = 1;
+			break;
+
+		case 'k':
+			keep_unchanged = 1;
+			break;
+
+		case 'n':
+			block_retries = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'j':
+			jrnl_dir = optarg;
+			break;
+
+		case 'N':
+			expected = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'Q':
+			idle_ms = strtoul(optarg, NULL, 10);
+			if (idle_ms < 1) {
+				fprintf(stderr, "query idle window needs at least 1 ms!\n");
+				return 1;
+			}
+			break;
+
+		case 't':
+			ready_ms = strtoul(optarg, NULL, 10);
+			if (ready_ms < 1) {
+				fprintf(stderr, "wait for the bootloader needs at least 1 ms!\n");
+				return 1;
+			}
+			break;
+
+		case 'w':
+			tx_window = strtoul(optarg, NULL, 10);
+			if (tx_window < 1) {
+				fprintf(stderr, "tx window must be at least one frame!\n");
+				return 1;
+			}
+			break;
+
+		case 'l':
+			bus_load = strtoul(optarg, NULL, 10);
+			if ((bus_load < 1) || (bus_load > 100)) {
+				fprintf(stderr, "bus load must be 1 .. 100 percent!\n");
+				return 1;
+			}
+			break;
+
+		case 'T':
+			if (!strcmp(optarg, "raw"))
+				backend = CANIO_RAW;
+			else if (!strcmp(optarg, "bcm"))
+				backend = CANIO_BCM;
+			else if (!strcmp(optarg, "ring"))
+				backend = CANIO_RING;
+			else if (!strcmp(optarg, "uring"))
+				backend = CANIO_URING;
+			else {
+				fprintf(stderr, "unknown transmit backend '%s'!\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 's':
+			rt_prio = strtoul(optarg, NULL, 10);
+			if ((rt_prio < sched_get_priority_min(SCHED_FIFO)) ||
+			    (rt_prio > sched_get_priority_max(SCHED_FIFO))) {
+				fprintf(stderr, "SCHED_FIFO priority %d out of range!\n", rt_prio);
+				return 1;
+			}
+			break;
+
+		case 'c':
+			rt_cpu = strtoul(optarg, NULL, 10);
+			break;
+
 		case '?':
 		default:
 			print_usage(basename(argv[0]));
@@ -130,52 +317,109 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if ((argc - optind) != 1 || (infile && query) || (!(infile || query))) {
+	/* inventory of the modules on the given or on all CAN interfaces */
+	if (inventory) {
+		if (infile || files[0] || query || profile) {
+			print_usage(basename(argv[0]));
+			return 0;
+		}
+		return inv_run(&argv[optind], argc - optind);
+	}
+
+	/* exactly one of flashing, query or profiling */
+	if ((argc - optind) < 1 || ((!!infile + !!files[0] + query + !!profile) != 1)) {
 		print_usage(basename(argv[0]));
 		return 0;
 	}
 
-	if ((s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("socket");
+	/* several interfaces are only handled for flashing */
+	if (((argc - optind) > 1) && (query || profile)) {
+		print_usage(basename(argv[0]));
+		return 0;
+	}
+
+	if ((argc - optind) > MAX_WORKERS) {
+		fprintf(stderr, "too many interfaces (max. %d)!\n", MAX_WORKERS);
 		return 1;
 	}
 
-	/* set single CAN ID raw filters for RX and TX frames */
-	rfilter.can_id	 = CAN_ID & CAN_SFF_MASK;
-	rfilter.can_mask = (CAN_SFF_MASK|CAN_EFF_FLAG|CAN_RTR_FLAG);
+	/* the journal and the flash compare handle a single module */
+	if ((members > 1) && (jrnl_dir || keep_unchanged)) {
+		fprintf(stderr, "journal and keeping unchanged blocks need a single module!\n");
+		return 1;
+	}
 
-	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
+	/* interleaved modules are written block by block */
+	if (files[0] && (verify_sectors || jrnl_dir || keep_unchanged)) {
+		fprintf(stderr, "sector verify, journal and keeping unchanged blocks need a single image!\n");
+		return 1;
+	}
 
-	/* copy netdev name for ioctl request */
-	strncpy(ifr.ifr_name, argv[optind], sizeof(ifr.ifr_name)-1);
+	/* nothing is programmed in a dry run */
+	if (dry_run) {
+		verify_sectors = 0;
+		jrnl_dir = NULL;
+	}
 
-	/* check tx queue length ... */
-	if (ioctl(s, SIOCGIFTXQLEN, &ifr) < 0) {
-		perror("SIOCGIFTXQLEN");
+	/* tx confirmations are only handled by the raw socket read path */
+	if ((backend != CANIO_RAW) && tx_window) {
+		fprintf(stderr, "tx window can only be used with the raw backend!\n");
 		return 1;
 	}
 
-	/* ... to be at least PCF_MIN_TX_QUEUE CAN frames */
-	if (ifr.ifr_qlen < PCF_MIN_TX_QUEUE) {
-		fprintf(stderr, "tx queue len %d is too small! Must be at least %d.\n",
-			ifr.ifr_qlen, PCF_MIN_TX_QUEUE);
-		return 1;
+	/* one worker process per CAN interface */
+	if ((argc - optind) > 1) {
+		i = work_start(work, &argv[optind], argc - optind);
+		if (i < 0)
+			return !!work_wait(work, argc - optind);
+
+		optind += i;
+
+		if (infile)
+			infile = work_reopen(infile);
+		for (m = 0; m < members && files[m]; m++)
+			files[m] = work_reopen(files[m]);
+
+		/* pin the workers to separate cpus */
+		if (rt_cpu != RT_NO_CPU)
+			rt_cpu = (rt_cpu + i) % get_nprocs_conf();
 	}
 
-	/* get interface index for bind() */
-	if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
-		perror("SIOCGIFINDEX");
+	if (canio_open(&io, argv[optind]))
 		return 1;
-	}
-	addr.can_ifindex = ifr.ifr_ifindex;
-	addr.can_family = AF_CAN;
 
-	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
+	/* use the echo of each sent frame as confirmation from the bus */
+	if (tx_window && canio_set_tx_window(&io, tx_window))
 		return 1;
+
+	/* pace the data frames to a share of the bus bitrate */
+	if (bus_load) {
+		if (canio_set_bus_load(&io, bus_load))
+			return 1;
+
+		printf("limit bus load to %d%% of %u bit/s (%d data frames/s)\n",
+		       bus_load, io.bitrate,
+		       (int)(io.pace_rate / canio_frame_bits(CAN_MAX_DLEN)));
 	}
 
-	entries = query_modules(s, modules);
+	if (backend != CANIO_RAW) {
+		if (canio_set_backend(&io, backend))
+			return 1;
+
+		if (backend == CANIO_BCM)
+			printf("send data frames with CAN_BCM in %ld us interval\n",
+			       canio_bcm_ival_us(&io, CAN_MAX_DLEN));
+	}
+
+	/* known module ids are addressed directly without the module query */
+	if ((module_id != NO_MODULE_ID) && !query) {
+		if (members)
+			entries = probe_modules(&io, group, members, modules);
+		else
+			entries = probe_modules(&io, &module_id, 1, modules);
+	} else
+		entries = query_modules(&io, modules, expected, idle_ms);
+
 	if (!entries) {
 		fprintf(stderr, "module query failed!\n");
 		return 1;
@@ -185,7 +429,7 @@ int main(int argc, char **argv)
 	printf("\nfound modules:\n\n");
 	for (i = 0; i < MAX_MODULES; i++) {
 		if (modules[i].can_id) {
-			if (eval_modules(s, i, &modules[i]))
+			if (eval_modules(&io, i, &modules[i]))
 				return 1;
 		}
 	}
@@ -213,61 +457,187 @@ int main(int argc, char **argv)
 			}
 		} else {
 			printf("\nmultiple modules found - please provide module id : ");
-			scanf("%d", &module_id);
+			fflush(stdout);
+			if (scanf("%d", &module_id) != 1) {
+				fprintf(stderr, "\nno module id provided!\n\n");
+				exit(1);
+			}
 			module_id &= MAX_MODULES_MASK;
 		}
 	}
 
-	if (!(modules[module_id].can_id)) {
-		fprintf(stderr, "\nmodule id not found in module list!\n\n");
-		exit(1);
+	if (!members)
+		group[members++] = module_id;
+
+	for (m = 0; m < members; m++) {
+		if (!(modules[group[m]].can_id)) {
+			fprintf(stderr, "\nmodule id %d not found in module list!\n\n", group[m]);
+			exit(1);
+		}
 	}
 
 	/* at this point we can properly address a module to perform a reset */
 	if (query && do_reset)
 		goto out_reset;
 
-	/* restore hw_type of this module_id index from data[7] */
-	hw_type = modules[module_id].data[7];
+	if (profile) {
+		if (canio_set_timestamping(&io))
+			return 1;
 
-	if (get_hw(hw_type) == NULL) {
-		fprintf(stderr, "\nno flash configuration available for hardware type %d!\n\n",
-			hw_type);
-		exit(1);
+		profile_module(&io, module_id, profile);
+		printf("\n");
+		canio_close(&io);
+		return 0;
 	}
 
-	if (check_ch_name(infile, hw_type)) {
-		fprintf(stderr, "\nno ch_filename in bin-file for hardware type %d (%s)!\n\n",
-			hw_type, get_hw_name(hw_type));
-		exit(1);
+	for (m = 0; m < members; m++) {
+		i = group[m];
+
+		/* restore hw_type of this module_id index from data[7] */
+		hw_type = modules[i].data[7];
+
+		if (get_hw(hw_type) == NULL) {
+			fprintf(stderr, "\nno flash configuration available for hardware type %d!\n\n",
+				hw_type);
+			exit(1);
+		}
+
+		/* each scheduled module gets its own image */
+		if (files[m])
+			infile = files[m];
+
+		if (check_ch_name(infile, hw_type)) {
+			fprintf(stderr, "\nno ch_filename in bin-file for hardware type %d (%s)!\n\n",
+				hw_type, get_hw_name(hw_type));
+			exit(1);
+		}
+
+		/* take default values when not provided by JSON config */
+		if (modules[i].can_dlc == NO_DATA_LEN) {
+			if (has_hw_flags(hw_type, DATA_MODE8))
+				modules[i].can_dlc = DATA_LEN8;
+			else
+				modules[i].can_dlc = DATA_LEN6;
+		}
+
+		blksz = get_max_blocksize(hw_type);
+		if ((blksz > BUFSZ) || (blksz < 32)) {
+			fprintf(stderr, "\nmax_blocksize %d out of range!\n\n", blksz);
+			exit(1);
+		}
+
+		printf("\nflashing module id %d with flash transfer data len %d and block size %d\n",
+		       i, modules[i].can_dlc, blksz);
+
+		fl[m].io = &io;
+		fl[m].dry_run = dry_run;
+		fl[m].flags = sess_flags;
+		fl[m].retries = block_retries;
+		fl[m].module_id = i;
+		fl[m].hw_type = hw_type;
+		fl[m].ftd_len = modules[i].can_dlc;
+		fl[m].alternating_xor_flip = has_hw_flags(hw_type, FDATA_INVERT);
+		fl[m].xfer_size = blksz;
 	}
 
-	/* take default values when not provided by JSON config */
-	if (modules[module_id].can_dlc == NO_DATA_LEN) {
-		if (has_hw_flags(hw_type, DATA_MODE8))
-			modules[module_id].can_dlc = DATA_LEN8;
-		else
-			modules[module_id].can_dlc = DATA_LEN6;
+	/* all modules of a multicast group take the same data frames */
+	for (m = 1; m < members && !files[0]; m++) {
+		if ((fl[m].hw_type != fl[0].hw_type) || (fl[m].ftd_len != fl[0].ftd_len)) {
+			fprintf(stderr, "\nmodule id %d differs from module id %d in hardware type "
+				"or data len!\n\n", group[m], module_id);
+			exit(1);
+		}
 	}
 
-	blksz = get_max_blocksize(hw_type);
-	if ((blksz > BUFSZ) || (blksz < 32)) {
-		fprintf(stderr, "\nmax_blocksize %d out of range!\n\n", blksz);
-		exit(1);
+	/* the single module or the multicast group */
+	hw_type = fl[0].hw_type;
+	blksz = fl[0].xfer_size;
+
+	/* the flash content is only compared with a reliable verify */
+	if (keep_unchanged && !has_hw_flags(hw_type, BLANK_CHECK)) {
+		printf("no blank check for hardware type %d (%s) - writing all blocks\n",
+		       hw_type, get_hw_name(hw_type));
+		keep_unchanged = 0;
 	}
+	if (files[0])
+		infile = files[0];
 
-	printf("\nflashing module id %d with flash transfer data len %d and block size %d\n",
-	       module_id, modules[module_id].can_dlc, blksz);
+	if (jrnl_dir) {
+		if (jrnl_open(&jr, jrnl_dir, argv[optind], module_id, jrnl_hash(infile)))
+			return 1;
+		fl[0].jrnl = &jr;
+
+		/* a restarted bootloader has no state of the interrupted run */
+		if (jr.records) {
+			get_status(&io, module_id, &cf);
+			if (cf.data[5]) {
+				printf("\nresume from journal %s\n", jr.path);
+				resume = 1;
+			} else {
+				printf("\nmodule id %d left the bootloader - discard journal %s\n",
+				       module_id, jr.path);
+				jrnl_reset(&jr);
+			}
+		}
+	}
 
-	if (has_hw_flags(hw_type, SWITCH_TO_BOOTLOADER)) { /* PPCAN mode modules */
-		printf("\nswitch module into bootloader ... ");
-		fflush(stdout);
-		switch_to_bootloader(s, module_id);
-		sleep(1);
-		get_status(s, module_id, NULL);
+	if (rt_prio || (rt_cpu != RT_NO_CPU)) {
+		printf("\nreal-time mode (SCHED_FIFO priority %d", rt_prio);
+		if (rt_cpu != RT_NO_CPU)
+			printf(", cpu %d", rt_cpu);
+		printf(")\n");
+
+		/* read the images into the page cache and pre-fault the block buffer */
+		rt_preload(fileno(infile));
+		for (m = 1; m < members && files[m]; m++)
+			rt_preload(fileno(files[m]));
+		rt_prefault(buf, sizeof(buf));
+
+		if (rt_enable(rt_prio, rt_cpu))
+			exit(1);
+	}
+
+	/* PPCAN mode modules */
+	for (m = 0, i = 0; m < members && !resume; m++) {
+		if (!has_hw_flags(fl[m].hw_type, SWITCH_TO_BOOTLOADER))
+			continue;
+
+		if (!i++) {
+			printf("\nswitch module into bootloader ... ");
+			fflush(stdout);
+		}
+		switch_to_bootloader(&io, group[m]);
+	}
+
+	if (i) {
+		for (m = 0; m < members; m++) {
+			if (has_hw_flags(fl[m].hw_type, SWITCH_TO_BOOTLOADER) &&
+			    wait_ready(&io, group[m], ready_ms, 1)) {
+				fprintf(stderr, "\nno answer from the bootloader of module id %d within %d ms!\n\n",
+					group[m], ready_ms);
+				return 1;
+			}
+		}
 		printf("done\n");
 	}
 
+	/* different images are flashed by interleaving the modules */
+	if (files[0]) {
+		printf("\nflashing %d modules interleaved:\n", members);
+
+		for (m = 0; m < members; m++) {
+			jobs[m].fl = &fl[m];
+			jobs[m].infile = files[m];
+		}
+
+		/* failed modules have been dropped by the scheduler */
+		if (sched_run(&io, jobs, members) == members) {
+			fprintf(stderr, "flashing of all modules failed!\n");
+			goto out_failed;
+		}
+		goto out_stats;
+	}
+
 	printf("\nerasing flash sectors:\n");
 
 	entries = get_num_flashblocks(hw_type);
@@ -276,18 +646,93 @@ int main(int argc, char **argv)
 			hw_type, get_hw_name(hw_type));
 		goto out_leave_bootloader;
 	}
-	for (i = 0; i < entries; i++)
-		erase_flashblocks(s, dry_run, infile, module_id, hw_type, i);
+	for (i = 0; i < entries; i++) {
+
+		/* no erase for unchanged sectors and changes in empty blocks */
+		if (keep_unchanged) {
+			flags = compare_flashblocks(&fl[0], infile, i, blksz, blkmap);
+			if ((flags < 0) && !drop_module(fl, members, 0))
+				goto out_failed;
+			if (flags)
+				continue;
+		}
+
+		for (m = 0; m < members; m++) {
+			if (!fl[m].failed && erase_flashblocks(&fl[m], infile, i) &&
+			    !drop_module(fl, members, m))
+				goto out_failed;
+		}
+	}
 
 	printf("\nwriting flash blocks:\n");
 	foffset = get_file_skip(hw_type);
-	alternating_xor_flip = has_hw_flags(hw_type, FDATA_INVERT);
 	crc_start = get_crc_startpos(hw_type);
 	floffset = get_flash_offset(hw_type);
 
+	eof = 0;
+	sector = -1;
+	strict_sector = -1;
+
 	while (1) {
 
-		if (fseek(infile, foffset, SEEK_SET))
+		if (!eof && fseek(infile, foffset, SEEK_SET))
+			eof = 1;
+
+		/* verify the programmed sector as a whole when leaving it */
+		if (verify_sectors || resume) {
+			i = (eof) ? -1 : get_flashblock(hw_type, foffset + floffset, blksz);
+
+			if (verify_sectors && (i != sector) && (sector >= 0) &&
+			    (sector != strict_sector) && (sector_programmed)) {
+				fblock = &get_hw(hw_type)->flashblocks[sector];
+
+				/* not written bytes are empty after the erase */
+				sector_csum += (fblock->len - sector_written) * EMPTY;
+
+				/* rewrite the sector when one of the modules fails */
+				rewrite = 0;
+				for (m = 0; m < members; m++) {
+					if (!fl[m].failed &&
+					    verify_sector(&fl[m], fblock->start, fblock->len, sector_csum))
+						rewrite = 1;
+				}
+
+				if (rewrite) {
+
+					printf("rewriting the blocks of the sector at startaddr 0x%06X\n",
+					       fblock->start);
+
+					for (m = 0; m < members; m++) {
+						if (!fl[m].failed &&
+						    erase_block(&fl[m], fblock->start, fblock->len) &&
+						    !drop_module(fl, members, m))
+							goto out_failed;
+					}
+
+					/* verify each block of this sector */
+					strict_sector = sector;
+					sector = -1;
+					foffset = sector_foffset;
+					eof = 0;
+
+					/* no block is kept after the erase */
+					if (keep_unchanged)
+						memset(&blkmap[(foffset - get_file_skip(hw_type)) / blksz],
+						       BLK_CHANGED, fblock->len / blksz);
+					continue;
+				}
+			}
+
+			if (i != sector) {
+				sector = i;
+				sector_foffset = foffset;
+				sector_csum = 0;
+				sector_written = 0;
+				sector_programmed = 0;
+			}
+		}
+
+		if (eof)
 			break;
 
 		memset(&buf, 0xFF, blksz);
@@ -305,61 +750,205 @@ int main(int argc, char **argv)
 			if ((crc_start) && (crc_start >= foffset) && (crc_start < foffset + blksz))
 				write_crc_array(&buf[crc_start - foffset], infile, crc_start);
 
+			/* skip the blocks programmed before the interruption */
+			skip = 0;
+			if (resume) {
+				i = resume_block(&fl[0], foffset + floffset, blksz, buf);
+				if ((i < 0) && !drop_module(fl, members, 0))
+					goto out_failed;
+
+				if (i == 2) {
+					/* write the erased sector from its start */
+					resume = 0;
+					fblock = &get_hw(hw_type)->flashblocks[sector];
+					foffset = fblock->start - floffset;
+					sector = -1;
+
+					if (keep_unchanged)
+						memset(&blkmap[(foffset - get_file_skip(hw_type)) / blksz],
+						       BLK_CHANGED, fblock->len / blksz);
+					continue;
+				}
+
+				if (i == 0) {
+					printf("skipping programmed block at offset 0x%X\n",
+					       (unsigned int)(foffset + floffset));
+					resumed++;
+					skip = 1;
+				} else {
+					/* first block to be written */
+					resume = 0;
+				}
+			}
+
+			if (!skip && keep_unchanged &&
+			    (blkmap[(foffset - get_file_skip(hw_type)) / blksz] == BLK_UNCHANGED)) {
+				kept++;
+				skip = 1;
+			}
+
+			/* defer the verification when the sector can be verified */
+			flags = 0;
+			if ((sector >= 0) && (sector != strict_sector)) {
+				flags |= SESS_NO_VERIFY;
+
+				/* skipped blocks are part of the sector checksum */
+				for (i = 0; i < blksz; i++)
+					sector_csum += buf[i];
+				sector_written += blksz;
+				if (!skip)
+					sector_programmed = 1;
+			}
+
 			/* write non-empty block */
-			write_block(s, dry_run, module_id, foffset + floffset, blksz,
-				    buf, alternating_xor_flip, modules[module_id].can_dlc);
+			if (!skip) {
+				if (!write_group(fl, members, foffset + floffset, blksz, buf, flags))
+					goto out_failed;
+				work_block_written();
+			}
 		}
 
-		if (feof(infile))
-			break;
-
-		foffset += blksz;
+		eof = feof(infile);
+		if (!eof)
+			foffset += blksz;
 
 	} /* while (1) */
 
+out_stats:
+	if (io.data_ns)
+		printf("\nsent %lu data frames in %lld ms (%lld frames/s)\n",
+		       io.data_frames, io.data_ns / 1000000,
+		       io.data_frames * 1000000000LL / io.data_ns);
+
+	if (tx_window)
+		printf("\n%lu of %lu frames confirmed on the bus\n",
+		       io.tx_confirmed, io.tx_sent);
+
+	if (io.rx_stale || io.rx_unexpected)
+		printf("\n%lu stale and %lu unexpected frames dropped\n",
+		       io.rx_stale, io.rx_unexpected);
+
+	if (io.block_retries)
+		printf("\n%lu block transfers repeated\n", io.block_retries);
+
+	if (resumed)
+		printf("\n%lu programmed blocks skipped from the journal\n", resumed);
+
+	if (kept)
+		printf("\n%lu unchanged blocks kept\n", kept);
+
+	/* the image is completely written */
+	if (fl[0].jrnl)
+		jrnl_close(&jr, 1);
+
+	if (io.rto_retries)
+		printf("\n%lu status requests repeated after timeout\n",
+		       io.rto_retries);
+
+	if (io.err_frames)
+		printf("\n%lu error frames - bus %s, tx/rx error counter %d/%d\n",
+		       io.err_frames, canio_state_name(&io),
+		       io.tx_errcnt, io.rx_errcnt);
+
+	/* jitter statistics of the time critical parts */
+	printf("\n");
+	canio_stat_print("data burst per frame", &io.burst_stat);
+	canio_stat_print("status round trip", &io.rtt_stat);
+
+	/* back to normal scheduling */
+	rt_restore();
+
 out_leave_bootloader:
-	if (has_hw_flags(hw_type, END_PROGRAMMING)) { /* recent hw modules */
-		printf("\nend programming ... ");
-		fflush(stdout);
-		end_programming(s, module_id);
-		sleep(1);
-		get_status(s, module_id, NULL);
+	for (m = 0, i = 0; m < members; m++) {
+		if (fl[m].failed || !has_hw_flags(fl[m].hw_type, END_PROGRAMMING))
+			continue;
+
+		/* recent hw modules */
+		if (!i++) {
+			printf("\nend programming ... ");
+			fflush(stdout);
+		}
+		end_programming(&io, group[m]);
+	}
+
+	if (i) {
+		for (m = 0; m < members; m++) {
+			if (!fl[m].failed && has_hw_flags(fl[m].hw_type, END_PROGRAMMING) &&
+			    wait_ready(&io, group[m], ready_ms, 0)) {
+				fprintf(stderr, "\nno answer from the bootloader of module id %d within %d ms!\n\n",
+					group[m], ready_ms);
+				return 1;
+			}
+		}
 		printf("done\n");
 	}
 
 out_reset:
-	if (has_hw_flags(hw_type, RESET_AFTER_FLASH) || do_reset) {
+	if (do_reset_all) {
+		printf("\nreset all modules ... ");
+		fflush(stdout);
+		reset_module(&io, 0xFF); /* module_id for all modules */
+	}
 
-		if (do_reset_all) {
-			printf("\nreset all modules ... ");
-			fflush(stdout);
-			reset_module(s, 0xFF); /* module_id for all modules */
-		} else {
-			printf("\nreset module id %d ... ", module_id);
+	for (m = 0; m < members; m++) {
+		if (fl[m].failed ||
+		    !(has_hw_flags(fl[m].hw_type, RESET_AFTER_FLASH) || do_reset))
+			continue;
+
+		if (!do_reset_all) {
+			printf("\nreset module id %d ... ", group[m]);
 			fflush(stdout);
-			reset_module(s, module_id);
+			reset_module(&io, group[m]);
 		}
 
-		sleep(1);
-
 		/* a reset which is issued by a command line option
 		 * likely leads into starting the application which
 		 * does not know about this status message. Therefore
 		 * only get the status when this is used in an original
 		 * PCAN flashing process, e.g. the PCAN Router Pro
 		 */
-		if (has_hw_flags(hw_type, RESET_AFTER_FLASH))
-			get_status(s, module_id, NULL);
+		if (has_hw_flags(fl[m].hw_type, RESET_AFTER_FLASH)) {
+			if (wait_ready(&io, group[m], ready_ms, 1)) {
+				fprintf(stderr, "\nno answer from module id %d after reset within %d ms!\n\n",
+					group[m], ready_ms);
+				return 1;
+			}
+		} else
+			usleep(READY_RESTART_MS * 1000);
 
-		printf("done\n");
+		if (!do_reset_all)
+			printf("done\n");
 	}
 
+	if (do_reset_all)
+		printf("done\n");
+
 	printf("\ndone.\n\n");
 
-	close(s);
+	canio_close(&io);
 
 	if (infile)
 		fclose(infile);
 
+	/* modules which failed in a multicast group */
+	for (m = 0, left = 0; m < members; m++) {
+		if (!fl[m].failed)
+			left++;
+	}
+
+	if (left < members) {
+		fprintf(stderr, "flashed %d of %d modules!\n\n", left, members);
+		return 1;
+	}
+
 	return 0;
+
+out_failed:
+	if (fl[0].jrnl)
+		jrnl_close(&jr, 0);
+
+	canio_close(&io);
+	fclose(infile);
+
+	return 1;
 }
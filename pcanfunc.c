@@ -39,19 +39,61 @@
 #include <linux/can/raw.h>
 
 #include "pcanflash.h"
+#include "pcanfunc.h"
 #include "pcanhw.h"
+#include "pcanio.h"
+#include "pcannl.h"
+#include "pcansess.h"
 #include "crc16.h"
 
-#define JSON_BUF_LEN 8000
+/* status probing interval while waiting for the bootloader */
+#define READY_PROBE_MIN_MS 10
+#define READY_PROBE_MAX_MS 200
 
-int query_modules(int s, struct can_frame *modules)
+/* width of the round trip histogram bars */
+#define HIST_BAR_LEN 50
+
+static long elapsed_us(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* status reply of the module: 0x7F 0xFF <module_id> <hw> <flash> <status> */
+int is_status_reply(struct can_frame *frame, uint8_t module_id)
+{
+	return (frame->can_dlc >= 6) &&
+		(frame->data[0] == 0x7F) && (frame->data[1] == 0xFF) &&
+		(frame->data[2] == module_id);
+}
+
+/* drop frames which are left over from previous commands */
+void drain_frames(canio_t *io)
+{
+	struct can_frame frame;
+
+	while (canio_read(io, &frame, 0))
+		io->rx_stale++;
+}
+
+/*
+ * Broadcast the module query and collect the replies. The query ends when
+ * 'expected' modules (0 = unknown) have answered or when no further reply
+ * shows up within the idle window. An idle window of 0 ms is estimated
+ * from the round trip of the first reply.
+ */
+int query_modules(canio_t *io, struct can_frame *modules, int expected, long idle_ms)
 {
 	int entries = 0;
-	int have_rx = 1;
-	int my_id, ret;
-	fd_set rdfs;
-	struct timeval tv;
+	int my_id;
 	struct can_frame frame;
+	struct timespec start;
+	long wait_ms = QUERY_TIMEOUT_MS;
+	long rtt_us;
 
 	/* send module query request */
 	memset(&frame, 0, sizeof(struct can_frame));
@@ -62,50 +104,48 @@ int query_modules(int s, struct can_frame *modules)
 	frame.data[1] = 0x00;
 	frame.data[2] = 0x06;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	drain_frames(io);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	canio_write(io, &frame, 1);
 
-	while (have_rx) {
+	/* collect replies until the idle window passes without further reply */
+	while (canio_read(io, &frame, wait_ms)) {
 
-		have_rx = 0;
-		FD_ZERO(&rdfs);
-		FD_SET(s, &rdfs);
-		tv.tv_sec = 1; /* 1s timeout */
-		tv.tv_usec = 0;
+		if (((frame.data[0] & 0xC0) != 0xC0) ||
+		    (frame.data[2] != 0x06) ||
+		    (frame.can_dlc != 8))
+		{
+			io->rx_unexpected++;
+			continue;
+		}
+		my_id = frame.data[1] & MAX_MODULES_MASK;
 
-		ret = select(s+1, &rdfs, NULL, NULL, &tv);
-		if (ret < 0) {
-			perror("select");
+		if ((modules + my_id)->can_id)
+		{
+			fprintf(stderr, "received second module with ID %d!\n", my_id);
 			exit(1);
 		}
+		frame.can_dlc = NO_DATA_LEN; /* prepare data mode storage */
+		memcpy(modules + my_id, &frame, sizeof(struct can_frame));
+		entries++;
 
-		if (FD_ISSET(s, &rdfs)) {
-			have_rx = 1;
-			ret = read(s, &frame, sizeof(struct can_frame));
-			if (ret < 0) {
-				perror("read");
-				exit(1);
-			}
+		/* first round trip sample of this module */
+		rtt_us = elapsed_us(&start);
+		sess_rto_sample(my_id, SESS_RTO_CMD, 0, rtt_us);
 
-			if ((frame.data[0] & 0xC0 != 0xC0) ||
-			    (frame.data[2] != 0x06) ||
-			    (frame.can_dlc != 8))
-			{
-				fprintf(stderr, "received wrong module query!\n");
-				exit(1);
-			}
-			my_id = frame.data[1] & MAX_MODULES_MASK;
+		/* no need to wait for further replies */
+		if (entries == expected)
+			break;
 
-			if ((modules + my_id)->can_id)
-			{
-				fprintf(stderr, "received second module with ID %d!\n", my_id);
-				exit(1);
-			}
-			frame.can_dlc = NO_DATA_LEN; /* prepare data mode storage */
-			memcpy(modules + my_id, &frame, sizeof(struct can_frame));
-			entries++;
+		/* the modules answer the broadcast at about the same time */
+		if ((entries == 1) && idle_ms)
+			wait_ms = idle_ms;
+		else if (entries == 1) {
+			wait_ms = QUERY_IDLE_FACTOR * rtt_us / 1000;
+			if (wait_ms < QUERY_IDLE_MIN_MS)
+				wait_ms = QUERY_IDLE_MIN_MS;
+			if (wait_ms > QUERY_TIMEOUT_MS)
+				wait_ms = QUERY_TIMEOUT_MS;
 		}
 	}
 
@@ -122,7 +162,7 @@ void init_set_cmd(struct can_frame *frame)
 	frame->data[1] = 0xFF;
 }
 
-void set_startaddress(int s, uint8_t module_id, uint32_t addr)
+void set_startaddress(canio_t *io, uint8_t module_id, uint32_t addr)
 {
 	struct can_frame frame;
 
@@ -133,13 +173,10 @@ void set_startaddress(int s, uint8_t module_id, uint32_t addr)
 	frame.data[5] = (addr >> 8) & 0xFF;
 	frame.data[6] = addr & 0xFF;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void set_blocksize(int s, uint8_t module_id, uint32_t size)
+void set_blocksize(canio_t *io, uint8_t module_id, uint32_t size)
 {
 	struct can_frame frame;
 
@@ -150,13 +187,10 @@ void set_blocksize(int s, uint8_t module_id, uint32_t size)
 	frame.data[5] = (size >> 8) & 0xFF;
 	frame.data[6] = size & 0xFF;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void set_checksum(int s, uint8_t module_id, uint16_t csum)
+void set_checksum(canio_t *io, uint8_t module_id, uint16_t csum)
 {
 	struct can_frame frame;
 
@@ -167,13 +201,10 @@ void set_checksum(int s, uint8_t module_id, uint16_t csum)
 	frame.data[5] = csum & 0xFF;
 	frame.data[6] = 0;
     
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void erase_sector(int s, uint8_t module_id)
+void erase_sector(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -184,13 +215,10 @@ void erase_sector(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
     
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void start_programming(int s, uint8_t module_id)
+void start_programming(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -201,13 +229,10 @@ void start_programming(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
     
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void verify(int s, uint8_t module_id)
+void verify(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -218,13 +243,10 @@ void verify(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
     
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void switch_to_bootloader(int s, uint8_t module_id)
+void switch_to_bootloader(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -235,13 +257,10 @@ void switch_to_bootloader(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void reset_module(int s, uint8_t module_id)
+void reset_module(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -252,13 +271,10 @@ void reset_module(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-void end_programming(int s, uint8_t module_id)
+void end_programming(canio_t *io, uint8_t module_id)
 {
 	struct can_frame frame;
 
@@ -269,17 +285,16 @@ void end_programming(int s, uint8_t module_id)
 	frame.data[5] = 0;
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
+	canio_write(io, &frame, 1);
 }
 
-uint8_t get_status(int s, uint8_t module_id, struct can_frame *cf)
+/* send a status request and wait for the status reply of this module */
+static int request_status(canio_t *io, uint8_t module_id, long timeout_us,
+			  struct can_frame *reply)
 {
 	struct can_frame frame;
-	fd_set rdfs;
-	struct timeval tv;
+	struct timespec start;
+	long remaining;
 	int ret;
 
 	init_set_cmd(&frame);
@@ -288,49 +303,219 @@ uint8_t get_status(int s, uint8_t module_id, struct can_frame *cf)
 	frame.data[4] = 0;
 	frame.data[5] = 0;
 	frame.data[6] = 0;
-    
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = canio_request(io, &frame, reply, timeout_us / 1000);
+
+	/* skip frames which are not the status reply of this module */
+	while (ret && !is_status_reply(reply, module_id)) {
+		io->rx_unexpected++;
+
+		remaining = (timeout_us - elapsed_us(&start)) / 1000;
+		ret = (remaining > 0) && canio_read(io, reply, remaining);
 	}
 
-	FD_ZERO(&rdfs);
-	FD_SET(s, &rdfs);
-	tv.tv_sec = 3; /* 3s timeout */
-	tv.tv_usec = 0;
+	return ret;
+}
 
-	ret = select(s+1, &rdfs, NULL, NULL, &tv);
-	if (ret < 0) {
-		perror("select");
-		exit(1);
+uint8_t get_status(canio_t *io, uint8_t module_id, struct can_frame *cf)
+{
+	struct can_frame reply;
+	struct timespec start;
+	long timeout_us;
+	int retry;
+
+	drain_frames(io);
+
+	/* repeat the request with doubled timeout */
+	for (retry = 0; retry <= SESS_RTO_RETRIES; retry++) {
+
+		timeout_us = sess_rto_us(module_id, SESS_RTO_CMD, 0) << retry;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (request_status(io, module_id, timeout_us, &reply)) {
+			/* only unambiguous round trips update the estimation */
+			if (!retry)
+				sess_rto_sample(module_id, SESS_RTO_CMD, 0,
+						elapsed_us(&start));
+
+			if (cf)
+				memcpy(cf, &reply, sizeof(struct can_frame));
+
+			return reply.data[5];
+		}
+
+		io->rto_retries++;
 	}
 
-	if (FD_ISSET(s, &rdfs)) {
-		ret = read(s, &frame, sizeof(struct can_frame));
-		if (ret < 0) {
-			perror("read");
-			exit(1);
+	fprintf(stderr, "timeout in get_status process after %ld ms (%s)!\n",
+		timeout_us / 1000, canio_state_name(io));
+	exit(1);
+}
+
+/*
+ * Address the known module ids directly with a status request instead of
+ * waiting for the replies to the module query. Returns the number of
+ * modules which answered.
+ */
+int probe_modules(canio_t *io, int *ids, int count, struct can_frame *modules)
+{
+	struct can_frame reply;
+	struct timespec start;
+	int i, my_id, entries = 0;
+
+	drain_frames(io);
+
+	for (i = 0; i < count; i++) {
+		my_id = ids[i] & MAX_MODULES_MASK;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!request_status(io, my_id, QUERY_TIMEOUT_MS * 1000, &reply)) {
+			fprintf(stderr, "no answer from module id %d!\n", my_id);
+			continue;
 		}
 
-		if (cf)
-			memcpy(cf, &frame, sizeof(struct can_frame));
+		/* first round trip sample of this module */
+		sess_rto_sample(my_id, SESS_RTO_CMD, 0, elapsed_us(&start));
 
-		return frame.data[5];
+		/* no module query reply available */
+		memset(modules + my_id, 0, sizeof(struct can_frame));
+		modules[my_id].can_id = CAN_ID;
+		modules[my_id].can_dlc = NO_DATA_LEN; /* prepare data mode storage */
+		entries++;
 	}
 
-	fprintf(stderr, "timeout in get_status process!\n");
-	exit(1);
+	return entries;
 }
 
-/* simple JSON parsing for relevant content */
+/*
+ * Wait for the bootloader after a mode change (switch to bootloader, end
+ * of programming, reset) by probing the status with increasing intervals.
+ * The application and the bootloader answer the status request until
+ * they restart, so with 'restart' the module has to stop answering for
+ * READY_PROBE_MAX_MS first. A module which still answers after
+ * READY_RESTART_MS is taken as restarted.
+ * Returns 0 as soon as the module answers and 1 after max_ms.
+ */
+int wait_ready(canio_t *io, uint8_t module_id, long max_ms, int restart)
+{
+	struct can_frame reply;
+	struct timespec start;
+	long probe_ms = READY_PROBE_MIN_MS;
+	long left_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	drain_frames(io);
+
+	while (restart && (elapsed_us(&start) / 1000 < READY_RESTART_MS)) {
+		if (!request_status(io, module_id, READY_PROBE_MAX_MS * 1000, &reply))
+			break;
+
+		usleep(READY_PROBE_MIN_MS * 1000);
+	}
+
+	/* late replies from before the restart */
+	drain_frames(io);
+
+	while (1) {
+		left_ms = max_ms - elapsed_us(&start) / 1000;
+		if (left_ms <= 0)
+			return 1;
+
+		if (probe_ms > left_ms)
+			probe_ms = left_ms;
+
+		if (request_status(io, module_id, probe_ms * 1000, &reply))
+			return 0;
+
+		probe_ms *= 2;
+		if (probe_ms > READY_PROBE_MAX_MS)
+			probe_ms = READY_PROBE_MAX_MS;
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Send 'count' status requests to the module and print the distribution
+ * of the round trip times from the kernel tx/rx timestamps.
+ */
+void profile_module(canio_t *io, uint8_t module_id, int count)
+{
+	int hist[32];
+	double *lat;
+	double req_us, reply_us;
+	uint32_t bitrate;
+	int i, b, first, last, maxcnt;
+
+	lat = malloc(count * sizeof(double));
+	if (!lat) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		get_status(io, module_id, NULL);
+		lat[i] = (io->rx_ts.tv_sec - io->tx_ts.tv_sec) * 1e6 +
+			(io->rx_ts.tv_nsec - io->tx_ts.tv_nsec) / 1e3;
+		if (lat[i] < 1)
+			lat[i] = 1;
+	}
+
+	qsort(lat, count, sizeof(double), cmp_double);
+
+	printf("\nround trip of %d status requests to module id %d:\n\n", count, module_id);
+	printf(" min %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n\n",
+	       lat[0], lat[(count - 1) * 50 / 100], lat[(count - 1) * 99 / 100],
+	       lat[count - 1]);
+
+	/* log2 histogram in us */
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < count; i++) {
+		for (b = 0; (b < 31) && ((1 << (b + 1)) <= lat[i]); b++)
+			;
+		hist[b]++;
+	}
+
+	for (first = 0; !hist[first]; first++)
+		;
+	for (last = 31; !hist[last]; last--)
+		;
+	for (b = first, maxcnt = 0; b <= last; b++) {
+		if (hist[b] > maxcnt)
+			maxcnt = hist[b];
+	}
+
+	for (b = first; b <= last; b++) {
+		printf(" %7d - %7d us: %6d ", 1 << b, 1 << (b + 1), hist[b]);
+		for (i = 0; i < hist[b] * HIST_BAR_LEN / maxcnt; i++)
+			printf("#");
+		printf("\n");
+	}
 
-#define J_HWTYPE "\"hwType\""
-#define J_BOOTLOADER "\"bootloader\""
-#define J_FIRMWARE "\"firmware\""
-#define J_HARDWARE "\"hardware\""
-#define J_DATAMODE "\"dataMode\""
-#define J_CANBERESET "\"canBeReset\""
+	/* separate the bus time from the bootloader turnaround */
+	if (!nl_get_bitrate(io->ifindex, &bitrate)) {
+		req_us = canio_frame_bits(7) * 1e6 / bitrate;
+		reply_us = canio_frame_bits(8) * 1e6 / bitrate;
 
+		printf("\n bus time per frame %.1f us (request) / %.1f us (reply) at %u bit/s\n",
+		       req_us, reply_us, bitrate);
+		printf(" bootloader turnaround (p50) %.1f us\n",
+		       lat[(count - 1) * 50 / 100] - req_us - reply_us);
+	}
+
+	free(lat);
+}
+
+/* simple JSON parsing for relevant content */
 char *findjsonstring(char *buf, const char *jsontag)
 {
 	char *ptr, *resultstr;
@@ -367,11 +552,9 @@ void restorejsonstring(char **ptr)
 	**ptr = '"';
 }
 
-uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, struct can_frame *cf)
+uint8_t get_json_config(canio_t *io, uint8_t module_id, struct can_frame *modules, struct can_frame *cf)
 {
 	struct can_frame frame;
-	fd_set rdfs;
-	struct timeval tv;
 
 	char buf[JSON_BUF_LEN];
 	char *ptr;
@@ -380,7 +563,7 @@ uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, str
 	unsigned char sn = 0; /* JSON PDU counter */
 	unsigned char rxsn; /* received JSON PDU counter */
 	unsigned int bufptr = 0;
-	int ret;
+	long timeout_ms = JSON_TIMEOUT_MS;
 
 	init_set_cmd(&frame);
 	frame.data[2] = module_id;
@@ -389,30 +572,15 @@ uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, str
 	frame.data[5] = 0xE8; /* 1000 us, low byte */
 	frame.data[6] = 0;
 
-	if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-		perror("write");
-		exit(1);
-	}
-
-	FD_ZERO(&rdfs);
-	FD_SET(s, &rdfs);
-	tv.tv_sec = 3; /* 3s timeout */
-	tv.tv_usec = 0;
+	drain_frames(io);
+	canio_write(io, &frame, 1);
 
 json_read_loop:
 
-	ret = select(s+1, &rdfs, NULL, NULL, &tv);
-	if (ret < 0) {
-		perror("select");
-		exit(1);
-	}
+	if (canio_read(io, &frame, timeout_ms)) {
 
-	if (FD_ISSET(s, &rdfs)) {
-		ret = read(s, &frame, sizeof(struct can_frame));
-		if (ret < 0) {
-			perror("read");
-			exit(1);
-		}
+		/* the following PDUs are sent in 1000 us distance */
+		timeout_ms = sess_rto_us(module_id, SESS_RTO_CMD, 0) / 1000;
 
 		if ((frame.data[0] != 0x7F) || (frame.data[1] != 0xFF)) {
 			fprintf(stderr, "wrong header in in JSON reply string!\n");
@@ -518,19 +686,26 @@ json_read_loop:
 	exit(1);
 }
 
-int eval_modules(int s, int module_id, struct can_frame *modules)
+int eval_modules(canio_t *io, int module_id, struct can_frame *modules)
 {
 	struct can_frame cf;
 
 	/* get status for this found module */
-	get_status(s, module_id, &cf);
+	get_status(io, module_id, &cf);
 
 	/* hardware type or flash type is 250 => get info via JSON config string */
 	if ((cf.data[3] == 250) || (cf.data[4] == 250)) {
-		if (get_json_config(s, module_id, modules, &cf)) {
+		if (get_json_config(io, module_id, modules, &cf)) {
 			fprintf(stderr, "\nError reading the JSON configuration string!\n\n");
 			exit(1);
 		}
+	} else if (!(modules->data[0] & 0xC0)) {
+		/* addressed directly without module query reply */
+		printf("module id %02d\n", module_id);
+
+		printf(" - hardware %d (%s) flash type %d (%s)\n",
+		       cf.data[3], get_hw_name(cf.data[3]),
+		       cf.data[4], get_flash_name(cf.data[4]));
 	} else {
 		printf("module id %02d (ppcan hw id %d)\n",
 		       module_id,
@@ -581,131 +756,298 @@ void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start)
 		       ca->mode);
 }
 
-void write_block(int s, int dry_run, uint8_t module_id, uint32_t offset, uint32_t blksz,
-		 uint8_t *buf, uint32_t alternating_xor_flip, uint8_t ftd_len)
+/*
+ * Write the block in parts of the current transfer size of the module.
+ * When the transfer of a part still fails after its retries the transfer
+ * size is halved for the rest of the flashing process.
+ */
+int write_block(flash_t *fl, uint32_t offset, uint32_t blksz, uint8_t *buf, int flags)
 {
-	struct can_frame frame;
-	int i, j, xor_flip;
-	uint8_t status;
-	uint16_t csum;
+	static sess_t sess;
+	sess_t *sp = &sess;
+	uint32_t pos, len;
+	int i;
 
-	for (i = 0, csum = 0; i < blksz; i++)
-		csum = (csum + *(buf +i)) & 0xFFFFU;
+	for (pos = 0; pos < blksz; pos += len) {
 
-	printf ("writing non empty block at offset 0x%X with csum 0x%04X\n",
-		(unsigned int)offset, (unsigned int)csum);
+		len = blksz - pos;
+		if (len > fl->xfer_size)
+			len = fl->xfer_size;
 
-	set_startaddress(s, module_id, offset);
-	status = get_status(s, module_id, NULL);
-	if ((status & SET_STARTADDR) != (SET_STARTADDR)) {
-		fprintf(stderr, "flash1 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	set_blocksize(s, module_id, blksz);
-	status = get_status(s, module_id, NULL);
-	if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
-		fprintf(stderr, "flash2 - wrong status %02X!\n", status);
-		exit(1);
-	}
+		/* skip empty parts of a split block */
+		if (len < blksz) {
+			for (i = 0; i < len; i++) {
+				if (buf[pos + i] != EMPTY)
+					break;
+			}
+			if (i == len)
+				continue;
+		}
 
-	frame.can_id = CAN_ID;
-	frame.can_dlc = 8;
-	xor_flip = 0;
+		sess_init(&sess, fl->io, fl->module_id, fl->dry_run);
+		sess_set_flags(&sess, fl->hw_type, fl->flags | flags);
+		sess_set_retries(&sess, fl->retries);
+		if (sess_write(&sess, offset + pos, len, buf + pos,
+			       fl->alternating_xor_flip, fl->ftd_len))
+			return 1;
+
+		printf ("writing non empty block at offset 0x%X with csum 0x%04X\n",
+			(unsigned int)(offset + pos), (unsigned int)sess.csum);
+
+		if (!sess_run(fl->io, &sp, 1))
+			continue;
 
-	/* prepare frame for DATA_LEN6 */
-	if (ftd_len == DATA_LEN6) {
-		frame.data[0] = 0x7F;
-		frame.data[1] = 0xFF;
+		/* programming errors are not fixed by smaller blocks */
+		if ((sess.failed_in >= SESS_PROGRAM) ||
+		    (fl->xfer_size / 2 < MIN_XFER_SIZE))
+			return 1;
+
+		fl->xfer_size /= 2;
+		printf("reduce block size to %d for module id %d\n",
+		       fl->xfer_size, fl->module_id);
+
+		/* repeat this part */
+		len = 0;
 	}
 
-	for (i = 0; i < blksz; i += ftd_len, xor_flip ^= 1) {
+	/* blocks without verify are recorded with their sector */
+	if (fl->jrnl && !(flags & SESS_NO_VERIFY))
+		jrnl_add(fl->jrnl, JRNL_BLOCK, offset, blksz);
 
-		uint8_t len = ftd_len;
+	return 0;
+}
 
-		if ((ftd_len == DATA_LEN6) && (i + ftd_len >= blksz)) {
-			/* last frame for DATA_LEN6 */
-			memset(&frame.data[2], 0, DATA_LEN6);
-			len = blksz - i;
-		}
+/* mark a failed module - returns the number of modules which are left */
+int drop_module(flash_t *fl, int count, int index)
+{
+	int i, left = 0;
 
-		for (j = 0; j < len; j++)
-			frame.data[j + (8 - ftd_len)] = *(buf + i + j);
+	fprintf(stderr, "\nflashing module id %d failed!\n\n", fl[index].module_id);
+	fl[index].failed = 1;
 
-		if ((xor_flip) && (alternating_xor_flip)) {
-			for (j = 0; j < len; j++)
-				frame.data[j + (8 - ftd_len)] ^= 0xFF;
-		}
+	for (i = 0; i < count; i++) {
+		if (!fl[i].failed)
+			left++;
+	}
 
-		if (write(s, &frame, sizeof(struct can_frame)) != sizeof(struct can_frame)) {
-			perror("write");
-			exit(1);
-		}
+	return left;
+}
+
+/*
+ * Write the block to the modules of a multicast group with one data burst.
+ * Each module gets its start address, block size and checksum and the
+ * modules which did not take the block get it again by unicast. Modules
+ * which failed after the program command are dropped. Returns the number
+ * of modules which are left.
+ */
+int write_group(flash_t *fl, int count, uint32_t offset, uint32_t blksz, uint8_t *buf, int flags)
+{
+	static sess_t sess[MAX_MODULES];
+	sess_t *sp[MAX_MODULES];
+	sess_t *msess[MAX_MODULES];
+	int i, n, left;
+
+	if (count == 1) {
+		if (write_block(fl, offset, blksz, buf, flags))
+			return drop_module(fl, count, 0);
+		return 1;
 	}
 
-	status = get_status(s, module_id, NULL);
-	if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
-		fprintf(stderr, "flash3 - wrong status %02X!\n", status);
-		exit(1);
+	/* modules with a reduced transfer size only get unicast blocks */
+	for (i = 0, n = 0; i < count; i++) {
+		msess[i] = NULL;
+		if (fl[i].failed || (fl[i].xfer_size < blksz))
+			continue;
+
+		sess_init(&sess[n], fl[i].io, fl[i].module_id, fl[i].dry_run);
+		sess_set_flags(&sess[n], fl[i].hw_type, fl[i].flags | flags | SESS_MULTICAST);
+		if (sess_write(&sess[n], offset, blksz, buf,
+			       fl[i].alternating_xor_flip, fl[i].ftd_len))
+			return 0;
+
+		msess[i] = sp[n] = &sess[n];
+		n++;
 	}
-	
-	set_checksum(s, module_id, csum);
-	status = get_status(s, module_id, NULL);
-	if (status != (SET_CHECKSUM_OK | SET_STARTADDR | SET_LENGTH | SET_CHECKSUM)) {
-		fprintf(stderr, "flash4 - wrong status %02X!\n", status);
-		exit(1);
+
+	if (n) {
+		printf ("writing non empty block at offset 0x%X with csum 0x%04X to %d modules\n",
+			(unsigned int)offset, (unsigned int)sess[0].csum, n);
+		sess_run(fl->io, sp, n);
 	}
-	
-	if (!dry_run) {
-		start_programming(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if (status != (SET_CHECKSUM_OK)) {
-			fprintf(stderr, "flash5 - wrong status %02X!\n", status);
-			exit(1);
+
+	for (i = 0, left = 0; i < count; i++) {
+		if (fl[i].failed)
+			continue;
+
+		/* taken from the multicast data burst */
+		if (msess[i] && (msess[i]->state == SESS_DONE)) {
+			left++;
+			continue;
 		}
-	
-		verify(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if (status != (SET_CHECKSUM_OK | SET_VERIFY_OK)) {
-			fprintf(stderr, "flash6 - wrong status %02X!\n", status);
-			exit(1);
+
+		/* the block must not be programmed twice without an erase */
+		if (msess[i] && (msess[i]->failed_in >= SESS_PROGRAM)) {
+			drop_module(fl, count, i);
+			continue;
 		}
+
+		if (write_block(&fl[i], offset, blksz, buf, flags))
+			drop_module(fl, count, i);
+		else
+			left++;
 	}
+
+	return left;
 }
 
-void erase_block(int s, int dry_run, uint8_t module_id, uint32_t startaddr, uint32_t blksz)
+int erase_block(flash_t *fl, uint32_t startaddr, uint32_t blksz)
 {
-	uint8_t status;
+	static sess_t sess;
+	sess_t *sp = &sess;
 
 	printf ("erasing block at startaddr 0x%06X with block size 0x%06X\n",
 		(unsigned int)startaddr, (unsigned int)blksz);
 
-	set_startaddress(s, module_id, startaddr);
-	status = get_status(s, module_id, NULL);
-	if ((!dry_run) && ((status & SET_STARTADDR) != SET_STARTADDR)) {
-		fprintf(stderr, "erase1 - wrong status %02X!\n", status);
-		exit(1);
-	}
-	
-	set_blocksize(s, module_id, blksz);
-	status = get_status(s, module_id, NULL);
-	if ((!dry_run) && ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH))) {
-		fprintf(stderr, "erase2 - wrong status %02X!\n", status);
-		exit(1);
+	/* void the former records of the sector before its erase */
+	if (fl->jrnl)
+		jrnl_add(fl->jrnl, JRNL_INVALID, startaddr, blksz);
+
+	sess_init(&sess, fl->io, fl->module_id, fl->dry_run);
+	sess_set_flags(&sess, fl->hw_type, fl->flags);
+	sess_erase(&sess, startaddr, blksz);
+
+	if (sess_run(fl->io, &sp, 1))
+		return 1;
+
+	if (fl->jrnl)
+		jrnl_add(fl->jrnl, JRNL_ERASED, startaddr, blksz);
+
+	return 0;
+}
+
+int verify_sector(flash_t *fl, uint32_t startaddr, uint32_t len, uint16_t csum)
+{
+	static sess_t sess;
+	sess_t *sp = &sess;
+
+	printf ("verifying sector at startaddr 0x%06X with size 0x%06X and csum 0x%04X\n",
+		(unsigned int)startaddr, (unsigned int)len, (unsigned int)csum);
+
+	sess_init(&sess, fl->io, fl->module_id, 0);
+	sess_set_flags(&sess, fl->hw_type, fl->flags);
+	sess_verify(&sess, startaddr, len, csum);
+
+	if (sess_run(fl->io, &sp, 1))
+		return 1;
+
+	if (fl->jrnl)
+		jrnl_add(fl->jrnl, JRNL_SECTOR, startaddr, len);
+
+	return 0;
+}
+
+/* check the flash content - returns 0 on match, 1 on mismatch, -1 on error */
+int probe_block(flash_t *fl, uint32_t startaddr, uint32_t len, uint16_t csum)
+{
+	static sess_t sess;
+	sess_t *sp = &sess;
+
+	sess_init(&sess, fl->io, fl->module_id, 0);
+	sess_set_flags(&sess, fl->hw_type, fl->flags | SESS_PROBE);
+	sess_verify(&sess, startaddr, len, csum);
+
+	if (!sess_run(fl->io, &sp, 1))
+		return 0;
+
+	return (sess.failed_in == SESS_VERIFY) ? 1 : -1;
+}
+
+/*
+ * Check a block of an interrupted flashing process. The last blocks may
+ * be programmed without being recorded in the journal. Returns 0 when the
+ * block is programmed, 1 when it is still empty, 2 when its sector had to
+ * be erased again and -1 on error. Without a blank check of the hardware
+ * the sector of the first unrecorded block is always erased again.
+ */
+int resume_block(flash_t *fl, uint32_t startaddr, uint32_t len, uint8_t *buf)
+{
+	const fblock_t *fblock;
+	uint16_t csum = 0;
+	int ret, i;
+
+	if (jrnl_done(fl->jrnl, startaddr, len))
+		return 0;
+
+	/* the sector was erased in this run */
+	i = get_flashblock(fl->hw_type, startaddr, len);
+	if (i < 0)
+		return 1;
+
+	fblock = &get_hw(fl->hw_type)->flashblocks[i];
+	if (!jrnl_erased(fl->jrnl, fblock->start, fblock->len))
+		return 1;
+
+	/* a verify without program command is not reliable */
+	if (!has_hw_flags(fl->hw_type, BLANK_CHECK)) {
+		printf("block at 0x%06X can not be checked - erase its sector again\n",
+		       (unsigned int)startaddr);
+		goto erase_sector;
 	}
-	
-	if (!dry_run) {
-		erase_sector(s, module_id);
-		status = get_status(s, module_id, NULL);
-		if ((status & SET_ERASE_OK) != SET_ERASE_OK) {
-			fprintf(stderr, "erase3 - wrong status %02X!\n", status);
-			exit(1);
-		}
+
+	for (i = 0; i < len; i++)
+		csum += buf[i];
+
+	ret = probe_block(fl, startaddr, len, csum);
+	if (!ret)
+		jrnl_add(fl->jrnl, JRNL_BLOCK, startaddr, len);
+	if (ret <= 0)
+		return ret;
+
+	ret = probe_block(fl, startaddr, len, (len * EMPTY) & 0xFFFF);
+	if (ret <= 0)
+		return (ret) ? ret : 1;
+
+	/* partly programmed block */
+	printf("block at 0x%06X is partly programmed - erase its sector again\n",
+	       (unsigned int)startaddr);
+
+erase_sector:
+	if (erase_block(fl, fblock->start, fblock->len))
+		return -1;
+
+	return 2;
+}
+
+/*
+ * Check for an empty flash range - returns 0 when empty, 1 otherwise and
+ * -1 on error. The range is verified in at least two parts, so a range
+ * with data which just adds up to the checksum of an empty range is not
+ * taken as empty.
+ */
+static int blank_check(flash_t *fl, uint32_t startaddr, uint32_t len)
+{
+	uint32_t chunk = len / 2;
+	uint32_t pos, size;
+	int ret;
+
+	if (chunk > BLANK_CHECK_CHUNK)
+		chunk = BLANK_CHECK_CHUNK;
+
+	for (pos = 0; pos < len; pos += size) {
+		size = len - pos;
+		if (size > chunk)
+			size = chunk;
+
+		ret = probe_block(fl, startaddr + pos, size, (size * EMPTY) & 0xFFFF);
+		if (ret)
+			return ret;
 	}
+
+	return 0;
 }
 
-void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id,
-		       uint8_t hw_type, int index)
+/* returns 1 when the image has content in the flash sector 'index' */
+int flashblock_used(FILE *infile, uint8_t hw_type, int index)
 {
 	const fblock_t *fblock;
 	uint8_t data;
@@ -724,7 +1066,7 @@ void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id,
 
 	/* skip handling of this flash block? */
 	if (fblock->skipped)
-		return;
+		return 0;
 
 	/* check for wrong flash_offset configuration */
 	if (fblock->start < flash_offset) {
@@ -737,22 +1079,158 @@ void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id,
 
 	/* check block in bin-file */
 	if (fseek(infile, fblock->start - flash_offset, SEEK_SET))
-		return;
+		return 0;
 
 	for (i = 0; i < fblock->len; i++) {
 		if (fread(&data, 1, 1, infile) != 1) {
 			/* file ended but was empty so far -> no action */
-			return;
+			return 0;
 		}
 		if (data != EMPTY)
 			break;
 	}
 
 	/* empty block (all bytes are EMPTY / 0xFFU) -> no action */
-	if (i == fblock->len)
-		return;
+	return i != fblock->len;
+}
+
+int erase_flashblocks(flash_t *fl, FILE *infile, int index)
+{
+	const fblock_t *fblock;
+	uint8_t hw_type = fl->hw_type;
+	int ret;
+
+	if (!flashblock_used(infile, hw_type, index))
+		return 0;
+
+	fblock = &get_hw(hw_type)->flashblocks[index];
+
+	/* erased before the flashing process was interrupted */
+	if (fl->jrnl && jrnl_erased(fl->jrnl, fblock->start, fblock->len)) {
+		printf ("skipping erased block at startaddr 0x%06X\n",
+			(unsigned int)fblock->start);
+		return 0;
+	}
+
+	/* already empty flash sector (e.g. after the production erase) */
+	if (has_hw_flags(hw_type, BLANK_CHECK)) {
+		ret = blank_check(fl, fblock->start, fblock->len);
+		if (ret < 0)
+			return 1;
+
+		if (!ret) {
+			printf ("skipping blank block at startaddr 0x%06X\n",
+				(unsigned int)fblock->start);
+			if (fl->jrnl)
+				jrnl_add(fl->jrnl, JRNL_ERASED, fblock->start, fblock->len);
+			return 0;
+		}
+	}
+
+	return erase_block(fl, fblock->start, fblock->len);
+}
+
+/* checksum of the image content - bytes behind the end of file are empty */
+static uint16_t file_csum(FILE *infile, long pos, uint32_t len)
+{
+	uint16_t csum = 0;
+	int data;
+
+	if (fseek(infile, pos, SEEK_SET))
+		return (len * EMPTY) & 0xFFFF;
+
+	while (len--) {
+		data = fgetc(infile);
+		csum += (data == EOF) ? EMPTY : data;
+	}
+
+	return csum;
+}
+
+/*
+ * Compare the flash sector 'index' with the image by verify commands
+ * and mark its blocks in blkmap (indexed by the file block). Returns 1
+ * when the sector does not need to be erased, 0 when it has to be erased
+ * and written as usual and -1 on error.
+ */
+int compare_flashblocks(flash_t *fl, FILE *infile, int index, uint32_t blksz, uint8_t *blkmap)
+{
+	const fblock_t *fblock = &get_hw(fl->hw_type)->flashblocks[index];
+	const uint32_t flash_offset = get_flash_offset(fl->hw_type);
+	const uint32_t file_skip = get_file_skip(fl->hw_type);
+	const uint32_t crc_start = get_crc_startpos(fl->hw_type);
+	uint32_t first, blocks, addr, i;
+	long pos;
+	int ret;
+
+	if (fblock->skipped || (fblock->start < flash_offset + file_skip))
+		return 0;
+
+	/* the blank check and the comparison need a verify without program */
+	if (!has_hw_flags(fl->hw_type, BLANK_CHECK))
+		return 0;
+
+	/* only sectors which consist of whole blocks */
+	pos = fblock->start - flash_offset;
+	if (((pos - file_skip) % blksz) || (fblock->len % blksz))
+		return 0;
+
+	/* the CRC array is patched while writing */
+	if (crc_start && (crc_start >= pos) && (crc_start < pos + fblock->len))
+		return 0;
+
+	first = (pos - file_skip) / blksz;
+	blocks = fblock->len / blksz;
+
+	ret = probe_block(fl, fblock->start, fblock->len,
+			  file_csum(infile, pos, fblock->len));
+	if (ret < 0)
+		return -1;
+
+	if (!ret) {
+		printf("sector at startaddr 0x%06X is unchanged\n",
+		       (unsigned int)fblock->start);
+		memset(&blkmap[first], BLK_UNCHANGED, blocks);
+		return 1;
+	}
+
+	ret = blank_check(fl, fblock->start, fblock->len);
+	if (ret < 0)
+		return -1;
+
+	if (!ret) {
+		memset(&blkmap[first], BLK_EMPTY, blocks);
+		return 1;
+	}
+
+	/* blocks can be added without erase when the changed blocks are empty */
+	for (i = 0; i < blocks; i++) {
+		addr = fblock->start + i * blksz;
+
+		ret = probe_block(fl, addr, blksz, file_csum(infile, pos + i * blksz, blksz));
+		if (!ret) {
+			blkmap[first + i] = BLK_UNCHANGED;
+			continue;
+		}
+
+		if (ret > 0)
+			ret = probe_block(fl, addr, blksz, (blksz * EMPTY) & 0xFFFF);
+		if (ret)
+			break;
+
+		blkmap[first + i] = BLK_EMPTY;
+	}
+
+	if (i < blocks) {
+		/* all blocks are written after the erase */
+		memset(&blkmap[first], BLK_CHANGED, blocks);
+		return (ret < 0) ? -1 : 0;
+	}
+
+	printf("sector at startaddr 0x%06X is changed in empty blocks only\n",
+	       (unsigned int)fblock->start);
 
-	erase_block(s, dry_run, module_id, fblock->start, fblock->len);
+	return 1;
 }
 
 int check_ch_name(FILE *infile, uint8_t hw_type)
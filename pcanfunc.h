@@ -25,25 +25,99 @@
  *
  */
 
+#ifndef __PCANFUNCH__
+#define __PCANFUNCH__
+
 #include <stdint.h>
 #include <linux/can.h>
 
-int query_modules(int s, struct can_frame *modules);
+#include "pcanio.h"
+#include "pcanjrnl.h"
+
+#define JSON_BUF_LEN 8000
+
+/* the bootloader needs some time to start the JSON string */
+#define JSON_TIMEOUT_MS 3000
+
+/* wait for the first reply to the module query */
+#define QUERY_TIMEOUT_MS 1000
+
+/* idle window after the first reply in multiples of its round trip */
+#define QUERY_IDLE_FACTOR 4
+#define QUERY_IDLE_MIN_MS 100
+
+#define J_HWTYPE "\"hwType\""
+#define J_BOOTLOADER "\"bootloader\""
+#define J_FIRMWARE "\"firmware\""
+#define J_HARDWARE "\"hardware\""
+#define J_DATAMODE "\"dataMode\""
+#define J_CANBERESET "\"canBeReset\""
+
+/* fixed wait after a mode change in former versions - a module which
+ * still answers after this time is taken as restarted
+ */
+#define READY_RESTART_MS 1000
+
+/* min. transfer size when the block size is reduced after failures */
+#define MIN_XFER_SIZE 32
+
+/* max. range of one blank check verify - the checksum of an empty range
+ * of a multiple of 64k is zero like the one of a zeroed range
+ */
+#define BLANK_CHECK_CHUNK 0x8000
+
+/* content of a flash block compared to the image */
+#define BLK_CHANGED	0	/* to be written after the erase of its sector */
+#define BLK_UNCHANGED	1	/* holds the content of the image */
+#define BLK_EMPTY	2	/* erased - to be written without erase */
+
+/* flashing process of a module */
+typedef struct {
+	canio_t *io;
+	int dry_run;
+	int flags;		/* SESS_* flags */
+	int retries;		/* retry budget per block */
+	uint8_t module_id;
+	uint8_t hw_type;
+	uint8_t ftd_len;	/* flash transfer data len */
+	uint32_t alternating_xor_flip;
+	uint32_t xfer_size;	/* current transfer block size */
+	jrnl_t *jrnl;		/* resume journal or NULL */
+	int failed;		/* module dropped from a multicast group */
+} flash_t;
+
+int is_status_reply(struct can_frame *frame, uint8_t module_id);
+void drain_frames(canio_t *io);
+int query_modules(canio_t *io, struct can_frame *modules, int expected, long idle_ms);
+int probe_modules(canio_t *io, int *ids, int count, struct can_frame *modules);
 void init_set_cmd(struct can_frame *frame);
-void set_startaddress(int s, uint8_t module_id, uint32_t addr);
-void set_blocksize(int s, uint8_t module_id, uint32_t size);
-void set_checksum(int s, uint8_t module_id, uint16_t csum);
-void erase_sector(int s, uint8_t module_id);
-void start_programming(int s, uint8_t module_id);
-void verify(int s, uint8_t module_id);
-void switch_to_bootloader(int s, uint8_t module_id);
-void reset_module(int s, uint8_t module_id);
-void end_programming(int s, uint8_t module_id);
-uint8_t get_status(int s, uint8_t module_id, struct can_frame *cf);
-uint8_t get_json_config(int s, uint8_t module_id, struct can_frame *modules, struct can_frame *cf);
-int eval_modules(int s, int module_id, struct can_frame *modules);
+void set_startaddress(canio_t *io, uint8_t module_id, uint32_t addr);
+void set_blocksize(canio_t *io, uint8_t module_id, uint32_t size);
+void set_checksum(canio_t *io, uint8_t module_id, uint16_t csum);
+void erase_sector(canio_t *io, uint8_t module_id);
+void start_programming(canio_t *io, uint8_t module_id);
+void verify(canio_t *io, uint8_t module_id);
+void switch_to_bootloader(canio_t *io, uint8_t module_id);
+void reset_module(canio_t *io, uint8_t module_id);
+void end_programming(canio_t *io, uint8_t module_id);
+uint8_t get_status(canio_t *io, uint8_t module_id, struct can_frame *cf);
+int wait_ready(canio_t *io, uint8_t module_id, long max_ms, int restart);
+void profile_module(canio_t *io, uint8_t module_id, int count);
+char *findjsonstring(char *buf, const char *jsontag);
+void restorejsonstring(char **ptr);
+uint8_t get_json_config(canio_t *io, uint8_t module_id, struct can_frame *modules, struct can_frame *cf);
+int eval_modules(canio_t *io, int module_id, struct can_frame *modules);
 void write_crc_array(uint8_t *buf, FILE *infile, uint32_t crc_start);
-void write_block(int s, int dry_run, uint8_t module_id, uint32_t offset, uint32_t blksz, uint8_t *buf, uint32_t alternating_xor_flip, uint8_t ftd_len);
-void erase_block(int s, int dry_run, uint8_t module_id, uint32_t startaddr, uint32_t blksz);
-void erase_flashblocks(int s, int dry_run, FILE *infile, uint8_t module_id, uint8_t hw_type, int index);
+int write_block(flash_t *fl, uint32_t offset, uint32_t blksz, uint8_t *buf, int flags);
+int write_group(flash_t *fl, int count, uint32_t offset, uint32_t blksz, uint8_t *buf, int flags);
+int drop_module(flash_t *fl, int count, int index);
+int erase_block(flash_t *fl, uint32_t startaddr, uint32_t blksz);
+int verify_sector(flash_t *fl, uint32_t startaddr, uint32_t len, uint16_t csum);
+int probe_block(flash_t *fl, uint32_t startaddr, uint32_t len, uint16_t csum);
+int resume_block(flash_t *fl, uint32_t startaddr, uint32_t len, uint8_t *buf);
+int flashblock_used(FILE *infile, uint8_t hw_type, int index);
+int erase_flashblocks(flash_t *fl, FILE *infile, int index);
+int compare_flashblocks(flash_t *fl, FILE *infile, int index, uint32_t blksz, uint8_t *blkmap);
 int check_ch_name(FILE *infile, uint8_t hw_type);
+
+#endif
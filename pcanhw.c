@@ -115,6 +115,27 @@ int get_num_flashblocks(uint8_t hw_type)
 	return 0;
 }
 
+/* index of the erased flash block which contains the given range or -1 */
+int get_flashblock(uint8_t hw_type, uint32_t addr, uint32_t len)
+{
+	const hw_t *hwt = get_hw(hw_type);
+	const fblock_t *fblock;
+	int i;
+
+	if (!hwt)
+		return -1;
+
+	for (i = 0; i < hwt->num_flashblocks; i++) {
+		fblock = &hwt->flashblocks[i];
+
+		if ((addr >= fblock->start) &&
+		    (addr + len <= fblock->start + fblock->len))
+			return (fblock->skipped) ? -1 : i;
+	}
+
+	return -1;
+}
+
 int check_flash_id_type(uint8_t hw_type, uint8_t flash_id_type)
 {
 	const hw_t *hwt = get_hw(hw_type);
@@ -69,6 +69,7 @@ typedef struct {
 #define RESET_AFTER_FLASH	(1<<2)
 #define END_PROGRAMMING		(1<<3)
 #define DATA_MODE8		(1<<4)
+#define BLANK_CHECK		(1<<5) /* verify works without program command */
 
 const hw_t *get_hw(uint8_t hw_type);
 uint32_t get_crc_startpos(uint8_t hw_type);
@@ -79,4 +80,5 @@ uint32_t has_hw_flags(uint8_t hw_type, const uint32_t flags);
 const char *get_hw_name(uint8_t hw_type);
 const char *get_flash_name(uint8_t flash_type);
 int get_num_flashblocks(uint8_t hw_type);
+int get_flashblock(uint8_t hw_type, uint32_t addr, uint32_t len);
 int check_flash_id_type(uint8_t hw_type, uint8_t flash_id_type);
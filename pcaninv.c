@@ -0,0 +1,587 @@
+/*
+ * pcaninv.c - module inventory of all CAN interfaces for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can/raw.h>
+
+#include "pcanflash.h"
+#include "pcanfunc.h"
+#include "pcanhw.h"
+#include "pcaninv.h"
+#include "pcannl.h"
+
+static inv_bus_t buses[MAX_INV_BUSES];
+static int inv_sock;
+
+static long ts_diff_ms(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void ts_add_ms(struct timespec *ts, struct timespec *now, long ms)
+{
+	ts->tv_sec = now->tv_sec + ms / 1000;
+	ts->tv_nsec = now->tv_nsec + (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void inv_send(inv_bus_t *bus, struct can_frame *frame)
+{
+	struct sockaddr_can addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = bus->ifindex;
+
+	/* CAN netdevs have short tx queues */
+	while (sendto(inv_sock, frame, sizeof(*frame), 0,
+		      (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno != ENOBUFS) {
+			perror("sendto");
+			exit(1);
+		}
+		usleep(INV_TX_BACKOFF_US);
+	}
+}
+
+/* read one frame from any CAN interface - returns its bus or NULL */
+static inv_bus_t *inv_recv(int count, struct can_frame *frame, long timeout_ms)
+{
+	struct sockaddr_can addr;
+	socklen_t len = sizeof(addr);
+	struct pollfd pfd;
+	int i, ret;
+
+	pfd.fd = inv_sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, (timeout_ms < 0) ? 0 : timeout_ms);
+	if (ret < 0) {
+		perror("poll");
+		exit(1);
+	}
+
+	if (!ret)
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	if (recvfrom(inv_sock, frame, sizeof(*frame), 0,
+		     (struct sockaddr *)&addr, &len) < 0) {
+		perror("recvfrom");
+		exit(1);
+	}
+
+	/* frames from CAN interfaces which are not in the inventory */
+	for (i = 0; i < count; i++) {
+		if (buses[i].ifindex == addr.can_ifindex)
+			return &buses[i];
+	}
+
+	return NULL;
+}
+
+/* open one socket for all CAN interfaces - returns the number of buses */
+static int inv_open(char **ifname, int count)
+{
+	struct sockaddr_can addr;
+	struct can_filter rfilter;
+	struct ifreq ifr;
+	int i;
+
+	if ((inv_sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* set single CAN ID raw filters for RX and TX frames */
+	rfilter.can_id	 = CAN_ID & CAN_SFF_MASK;
+	rfilter.can_mask = (CAN_SFF_MASK|CAN_EFF_FLAG|CAN_RTR_FLAG);
+
+	setsockopt(inv_sock, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
+
+	/* given interfaces or all CAN netdevs which are up */
+	if (count) {
+		for (i = 0; i < count; i++) {
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, ifname[i], sizeof(ifr.ifr_name) - 1);
+
+			if (ioctl(inv_sock, SIOCGIFINDEX, &ifr) < 0) {
+				perror("SIOCGIFINDEX");
+				return -1;
+			}
+
+			buses[i].ifindex = ifr.ifr_ifindex;
+			strcpy(buses[i].ifname, ifr.ifr_name);
+		}
+	} else {
+		int ifindex[MAX_INV_BUSES];
+		char names[MAX_INV_BUSES][IF_NAMESIZE];
+
+		count = nl_get_can_links(ifindex, names, MAX_INV_BUSES);
+		if (count < 0)
+			return -1;
+
+		for (i = 0; i < count; i++) {
+			buses[i].ifindex = ifindex[i];
+			strcpy(buses[i].ifname, names[i]);
+		}
+	}
+
+	/* receive from all CAN interfaces */
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = 0;
+
+	if (bind(inv_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		buses[i].json_id = -1;
+
+	return count;
+}
+
+/* latest deadline of all buses */
+static long inv_wait_ms(int count, struct timespec *now)
+{
+	long wait_ms = -1;
+	long ms;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		ms = ts_diff_ms(now, &buses[i].deadline);
+		if (ms > wait_ms)
+			wait_ms = ms;
+	}
+
+	return wait_ms;
+}
+
+/* send the module query on all buses at once and collect the replies
+ * until each bus was idle for its idle window
+ */
+static void inv_query(int count)
+{
+	struct can_frame frame;
+	struct timespec start, now;
+	inv_module_t *m;
+	inv_bus_t *bus;
+	int i, my_id;
+
+	memset(&frame, 0, sizeof(struct can_frame));
+
+	frame.can_id = CAN_ID;
+	frame.can_dlc = 3;
+	frame.data[0] = 0x80;
+	frame.data[1] = 0x00;
+	frame.data[2] = 0x06;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		inv_send(&buses[i], &frame);
+		ts_add_ms(&buses[i].deadline, &start, QUERY_TIMEOUT_MS);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (inv_wait_ms(count, &now) > 0) {
+
+		bus = inv_recv(count, &frame, inv_wait_ms(count, &now));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (!bus || ((frame.data[0] & 0xC0) != 0xC0) ||
+		    (frame.data[2] != 0x06) || (frame.can_dlc != 8))
+			continue;
+
+		my_id = frame.data[1] & MAX_MODULES_MASK;
+		m = &bus->modules[my_id];
+
+		if (m->state != INV_EMPTY) {
+			fprintf(stderr, "received second module with ID %d on %s!\n",
+				my_id, bus->ifname);
+			continue;
+		}
+
+		m->query = frame;
+		m->state = INV_QUERIED;
+
+		/* the modules answer the broadcast at about the same time */
+		if (!bus->entries++) {
+			bus->idle_ms = QUERY_IDLE_FACTOR * ts_diff_ms(&start, &now);
+			if (bus->idle_ms < QUERY_IDLE_MIN_MS)
+				bus->idle_ms = QUERY_IDLE_MIN_MS;
+			if (bus->idle_ms > QUERY_TIMEOUT_MS)
+				bus->idle_ms = QUERY_TIMEOUT_MS;
+		}
+		ts_add_ms(&bus->deadline, &now, bus->idle_ms);
+	}
+}
+
+/* request the status of all found modules at once */
+static void inv_status(int count)
+{
+	struct can_frame frame;
+	struct timespec now, deadline;
+	inv_module_t *m;
+	inv_bus_t *bus;
+	int i, id, pending = 0;
+
+	for (i = 0; i < count; i++) {
+		for (id = 0; id < MAX_MODULES; id++) {
+			if (buses[i].modules[id].state != INV_QUERIED)
+				continue;
+
+			init_set_cmd(&frame);
+			frame.data[2] = id;
+			frame.data[3] = CAN2FLASH_STATE_REQUEST;
+			inv_send(&buses[i], &frame);
+			pending++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts_add_ms(&deadline, &now, QUERY_TIMEOUT_MS);
+
+	while (pending && (ts_diff_ms(&now, &deadline) > 0)) {
+
+		bus = inv_recv(count, &frame, ts_diff_ms(&now, &deadline));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (!bus)
+			continue;
+
+		id = frame.data[2] & MAX_MODULES_MASK;
+		m = &bus->modules[id];
+
+		if ((m->state != INV_QUERIED) || !is_status_reply(&frame, id))
+			continue;
+
+		m->hw_type = frame.data[3];
+		m->flash_type = frame.data[4];
+		pending--;
+
+		/* hardware type or flash type is 250 => get info via JSON config string */
+		if ((m->hw_type == 250) || (m->flash_type == 250)) {
+			m->state = INV_JSON;
+			continue;
+		}
+
+		m->state = INV_DONE;
+	}
+
+	for (i = 0; i < count; i++) {
+		for (id = 0; id < MAX_MODULES; id++) {
+			m = &buses[i].modules[id];
+			if (m->state == INV_QUERIED) {
+				m->state = INV_FAILED;
+				m->error = "no status reply";
+			}
+		}
+	}
+}
+
+static void inv_json_parse(inv_module_t *m, char *buf)
+{
+	unsigned int hwType;
+	char *ptr;
+
+	ptr = findjsonstring(buf, J_BOOTLOADER);
+	if (ptr) {
+		strncpy(m->bootloader, ptr, INV_STR_LEN - 1);
+		restorejsonstring(&ptr);
+	}
+
+	ptr = findjsonstring(buf, J_FIRMWARE);
+	if (ptr) {
+		strncpy(m->firmware, ptr, INV_STR_LEN - 1);
+		restorejsonstring(&ptr);
+	}
+
+	ptr = findjsonstring(buf, J_HWTYPE);
+	if (ptr) {
+		if (sscanf(ptr, "%d", &hwType) == 1) {
+			m->hw_type = hwType & 0xFF;
+			m->flash_type = hwType & 0xFF;
+		}
+		restorejsonstring(&ptr);
+	}
+
+	ptr = findjsonstring(buf, J_DATAMODE);
+	if (ptr) {
+		if (*ptr == '0')
+			m->ftd_len = DATA_LEN6;
+		else if (*ptr == '1')
+			m->ftd_len = DATA_LEN8;
+		restorejsonstring(&ptr);
+	}
+}
+
+static void inv_json_end(inv_bus_t *bus, const char *error)
+{
+	inv_module_t *m = &bus->modules[bus->json_id];
+
+	if (error) {
+		m->state = INV_FAILED;
+		m->error = error;
+	} else {
+		inv_json_parse(m, bus->json);
+		m->state = INV_DONE;
+	}
+
+	bus->json_id = -1;
+}
+
+/* collect the JSON descriptor PDUs of the current module of the bus */
+static void inv_json_frame(inv_bus_t *bus, struct can_frame *frame, struct timespec *now)
+{
+	uint8_t rxsn;
+
+	if ((frame->data[0] != 0x7F) || (frame->data[1] != 0xFF)) {
+		inv_json_end(bus, "wrong header in JSON reply");
+		return;
+	}
+
+	/* the following PDUs are sent in 1000 us distance */
+	ts_add_ms(&bus->deadline, now, QUERY_IDLE_MIN_MS);
+
+	rxsn = frame->data[2];
+	if (rxsn == 0x00) {
+
+		/* start sequence */
+		memset(bus->json, 0, sizeof(bus->json));
+		memcpy(bus->json, &frame->data[3], 5);
+		bus->json_len = 5;
+		bus->json_sn = 0;
+
+	} else if ((rxsn == 0xFF) || (rxsn == bus->json_sn + 1)) {
+
+		memcpy(&bus->json[bus->json_len], &frame->data[3], 5);
+		bus->json_len += 5;
+		bus->json_sn = rxsn;
+
+		/* rxsn sequence is .. 0xFD 0xFE 0x01 0x02 .. */
+		if (bus->json_sn == 0xFE)
+			bus->json_sn = 0;
+
+		/* ensure buffer size and trailing zero */
+		if (bus->json_len >= (JSON_BUF_LEN - 6)) {
+			inv_json_end(bus, "JSON buffer length overflow");
+			return;
+		}
+	} else {
+		inv_json_end(bus, "JSON reception error");
+		return;
+	}
+
+	if (rxsn == 0xFF)
+		inv_json_end(bus, NULL);
+}
+
+/* get the JSON descriptors - one module per bus at a time */
+static void inv_json(int count)
+{
+	struct can_frame frame;
+	struct timespec now;
+	inv_bus_t *bus;
+	long wait_ms;
+	int i, id, active;
+
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i = 0, active = 0, wait_ms = -1; i < count; i++) {
+			bus = &buses[i];
+
+			/* the descriptor transfer timed out */
+			if ((bus->json_id >= 0) && (ts_diff_ms(&now, &bus->deadline) <= 0))
+				inv_json_end(bus, "no JSON descriptor");
+
+			for (id = 0; (bus->json_id < 0) && (id < MAX_MODULES); id++) {
+				if (bus->modules[id].state != INV_JSON)
+					continue;
+
+				init_set_cmd(&frame);
+				frame.data[2] = id;
+				frame.data[3] = CAN2FLASH_GET_JSON_DESCRIPTOR;
+				frame.data[4] = 0x03; /* 1000 us, high byte */
+				frame.data[5] = 0xE8; /* 1000 us, low byte */
+				frame.data[6] = 0;
+				inv_send(bus, &frame);
+
+				bus->json_id = id;
+				bus->json_len = 0;
+				bus->json_sn = 0;
+				ts_add_ms(&bus->deadline, &now, JSON_TIMEOUT_MS);
+			}
+
+			if (bus->json_id < 0)
+				continue;
+
+			active++;
+			if ((wait_ms < 0) || (ts_diff_ms(&now, &bus->deadline) < wait_ms))
+				wait_ms = ts_diff_ms(&now, &bus->deadline);
+		}
+
+		if (!active)
+			break;
+
+		bus = inv_recv(count, &frame, wait_ms);
+		if (bus && (bus->json_id >= 0)) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			inv_json_frame(bus, &frame, &now);
+		}
+	}
+}
+
+/* print a string from the module as JSON string */
+static void inv_print_str(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if ((*str == '"') || (*str == '\\'))
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04X", (unsigned char)*str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void inv_print_module(int id, inv_module_t *m)
+{
+	struct can_frame *q = &m->query;
+
+	printf("  {\"module_id\": %d, \"ppcan_hw_id\": %d", id,
+	       ((q->data[0] << 2) | (q->data[1] >> 6)) & 0xFF);
+
+	if (m->bootloader[0]) {
+		printf(", \"bootloader\": ");
+		inv_print_str(m->bootloader);
+	} else
+		printf(", \"date\": \"%02X.%02X.20%02X\", \"bootloader\": \"v%d.%d\"",
+		       q->data[3], q->data[4], q->data[5], q->data[6] >> 5, q->data[6] & 0x1F);
+
+	if (m->firmware[0]) {
+		printf(", \"firmware\": ");
+		inv_print_str(m->firmware);
+	}
+
+	if (m->state == INV_DONE) {
+		printf(", \"hw_type\": %d, \"hw_name\": \"%s\", \"flash_type\": %d, \"flash_name\": \"%s\"",
+		       m->hw_type, get_hw_name(m->hw_type),
+		       m->flash_type, get_flash_name(m->flash_type));
+
+		/* take default values when not provided by JSON config */
+		if (m->ftd_len == NO_DATA_LEN)
+			m->ftd_len = has_hw_flags(m->hw_type, DATA_MODE8) ? DATA_LEN8 : DATA_LEN6;
+		printf(", \"data_len\": %d", m->ftd_len);
+
+		/* check if hardware fits to known flash id type */
+		if (check_flash_id_type(m->hw_type, m->flash_type)) {
+			m->state = INV_FAILED;
+			m->error = "flash id type does not match the hardware id";
+		}
+	}
+
+	if (m->state == INV_DONE)
+		printf(", \"state\": \"ok\"}");
+	else
+		printf(", \"state\": \"%s\"}", m->error);
+}
+
+/*
+ * Inventory of the modules on the given or on all CAN interfaces as JSON
+ * on stdout. The module query, the status requests and the JSON
+ * descriptor transfers run on all interfaces at the same time.
+ */
+int inv_run(char **ifname, int count)
+{
+	struct timespec start, end;
+	int i, id, modules, n;
+
+	if (count > MAX_INV_BUSES) {
+		fprintf(stderr, "too many interfaces (max. %d)!\n", MAX_INV_BUSES);
+		return 1;
+	}
+
+	count = inv_open(ifname, count);
+	if (count < 0)
+		return 1;
+
+	if (!count) {
+		fprintf(stderr, "no CAN interfaces found!\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	inv_query(count);
+	inv_status(count);
+	inv_json(count);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("{\"interfaces\": [\n");
+	for (i = 0, modules = 0; i < count; i++) {
+		printf(" {\"interface\": ");
+		inv_print_str(buses[i].ifname);
+		printf(", \"modules\": [");
+
+		for (id = 0, n = 0; id < MAX_MODULES; id++) {
+			if (buses[i].modules[id].state == INV_EMPTY)
+				continue;
+
+			printf("%s\n", (n++) ? "," : "");
+			inv_print_module(id, &buses[i].modules[id]);
+		}
+		modules += n;
+
+		printf("%s]}%s\n", (n) ? "\n " : "", (i < count - 1) ? "," : "");
+	}
+	printf("]}\n");
+
+	fprintf(stderr, "found %d modules on %d interfaces in %ld ms\n",
+		modules, count, ts_diff_ms(&start, &end));
+
+	close(inv_sock);
+
+	return 0;
+}
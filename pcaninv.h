@@ -0,0 +1,79 @@
+/*
+ * pcaninv.h - module inventory of all CAN interfaces for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANINVH__
+#define __PCANINVH__
+
+#include <stdint.h>
+#include <time.h>
+#include <net/if.h>
+#include <linux/can.h>
+
+#include "pcanfunc.h"
+
+#define MAX_INV_BUSES 32
+
+/* max. length of the version strings from the JSON descriptor */
+#define INV_STR_LEN 32
+
+/* wait for the tx queue of the CAN netdev */
+#define INV_TX_BACKOFF_US 100
+
+/* inventory states of a module */
+#define INV_EMPTY	0
+#define INV_QUERIED	1	/* answered the module query */
+#define INV_JSON	2	/* waits for its JSON descriptor */
+#define INV_DONE	3
+#define INV_FAILED	4
+
+typedef struct {
+	int state;
+	const char *error;
+	struct can_frame query;	/* reply to the module query */
+	uint8_t hw_type;
+	uint8_t flash_type;
+	uint8_t ftd_len;
+	char bootloader[INV_STR_LEN];
+	char firmware[INV_STR_LEN];
+} inv_module_t;
+
+typedef struct {
+	int ifindex;
+	char ifname[IF_NAMESIZE];
+	int entries;
+	inv_module_t modules[MAX_MODULES];
+	long idle_ms;		/* idle window of the module query */
+	struct timespec deadline;
+	/* JSON descriptor transfer of one module at a time */
+	int json_id;
+	uint8_t json_sn;
+	unsigned int json_len;
+	char json[JSON_BUF_LEN];
+} inv_bus_t;
+
+int inv_run(char **ifname, int count);
+
+#endif
@@ -0,0 +1,1222 @@
+/*
+ * pcanio.c - CAN I/O layer for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#define _GNU_SOURCE /* sendmmsg() */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/can/bcm.h>
+#include <linux/can/error.h>
+
+#include "pcanflash.h"
+#include "pcanio.h"
+#include "pcannl.h"
+
+#ifndef CAN_ERR_CNT
+#define CAN_ERR_CNT 0x00000200U /* TX error counter / data[6] */
+#endif
+
+/* error frames to track the CAN controller state */
+#define CANIO_ERR_MASK (CAN_ERR_TX_TIMEOUT | CAN_ERR_CRTL | CAN_ERR_PROT | \
+			CAN_ERR_ACK | CAN_ERR_BUSOFF | CAN_ERR_BUSERROR | \
+			CAN_ERR_RESTARTED | CAN_ERR_CNT)
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static long long ts_diff_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+int canio_open(canio_t *io, const char *ifname)
+{
+	struct sockaddr_can addr;
+	struct can_filter rfilter;
+	can_err_mask_t err_mask = CANIO_ERR_MASK;
+	struct ifreq ifr;
+
+	memset(io, 0, sizeof(*io));
+	io->bcm = -1;
+	io->pkt = -1;
+	io->uring.fd = -1;
+
+	if ((io->s = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	/* set single CAN ID raw filters for RX and TX frames */
+	rfilter.can_id	 = CAN_ID & CAN_SFF_MASK;
+	rfilter.can_mask = (CAN_SFF_MASK|CAN_EFF_FLAG|CAN_RTR_FLAG);
+
+	setsockopt(io->s, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
+
+	/* receive error frames to adapt the transmission to the bus state */
+	setsockopt(io->s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+
+	/* copy netdev name for ioctl request */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name)-1);
+
+	/* the tx queue length determines the sendmmsg() batch size */
+	if (ioctl(io->s, SIOCGIFTXQLEN, &ifr) < 0) {
+		perror("SIOCGIFTXQLEN");
+		goto out_close;
+	}
+	io->txqlen = ifr.ifr_qlen;
+
+	/* get interface index for bind() */
+	if (ioctl(io->s, SIOCGIFINDEX, &ifr) < 0) {
+		perror("SIOCGIFINDEX");
+		goto out_close;
+	}
+	io->ifindex = ifr.ifr_ifindex;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_ifindex = io->ifindex;
+	addr.can_family = AF_CAN;
+
+	if (bind(io->s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		goto out_close;
+	}
+
+	return 0;
+
+out_close:
+	close(io->s);
+	io->s = -1;
+	return 1;
+}
+
+/*
+ * With CAN_RAW_RECV_OWN_MSGS the kernel echoes every frame of this socket
+ * when it has been sent on the bus. These echoes are used as tx
+ * confirmations to limit the number of frames in flight to 'window'.
+ */
+int canio_set_tx_window(canio_t *io, int window)
+{
+	int recv_own_msgs = (window > 0);
+
+	if (setsockopt(io->s, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS,
+		       &recv_own_msgs, sizeof(recv_own_msgs)) < 0) {
+		perror("setsockopt CAN_RAW_RECV_OWN_MSGS");
+		return 1;
+	}
+
+	io->tx_window = window;
+
+	return 0;
+}
+
+static int canio_open_bcm(canio_t *io)
+{
+	struct sockaddr_can addr;
+
+	if ((io->bcm = socket(PF_CAN, SOCK_DGRAM, CAN_BCM)) < 0) {
+		perror("bcm socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_ifindex = io->ifindex;
+	addr.can_family = AF_CAN;
+
+	if (connect(io->bcm, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bcm connect");
+		close(io->bcm);
+		io->bcm = -1;
+		return 1;
+	}
+
+	/* the frame interval is derived from the bitrate if available */
+	if (!io->bitrate)
+		nl_get_bitrate(io->ifindex, &io->bitrate);
+
+	return 0;
+}
+
+/* AF_PACKET socket with a mmap'ed PACKET_TX_RING on the CAN netdev */
+static int canio_open_ring(canio_t *io)
+{
+	struct sockaddr_ll addr;
+	struct tpacket_req req;
+	int version = TPACKET_V2;
+
+	if ((io->pkt = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_CAN))) < 0) {
+		perror("packet socket");
+		return 1;
+	}
+
+	if (setsockopt(io->pkt, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt PACKET_VERSION");
+		goto out_close;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = CANIO_RING_BLOCK_SIZE;
+	req.tp_frame_size = CANIO_RING_FRAME_SIZE;
+	req.tp_block_nr = CANIO_RING_FRAMES * CANIO_RING_FRAME_SIZE / CANIO_RING_BLOCK_SIZE;
+	req.tp_frame_nr = CANIO_RING_FRAMES;
+
+	if (setsockopt(io->pkt, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt PACKET_TX_RING");
+		goto out_close;
+	}
+
+	io->ring = mmap(NULL, CANIO_RING_FRAMES * CANIO_RING_FRAME_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, io->pkt, 0);
+	if (io->ring == MAP_FAILED) {
+		perror("mmap PACKET_TX_RING");
+		io->ring = NULL;
+		goto out_close;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_CAN);
+	addr.sll_ifindex = io->ifindex;
+
+	if (bind(io->pkt, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("packet bind");
+		goto out_unmap;
+	}
+
+	io->ring_head = 0;
+
+	return 0;
+
+out_unmap:
+	munmap(io->ring, CANIO_RING_FRAMES * CANIO_RING_FRAME_SIZE);
+	io->ring = NULL;
+out_close:
+	close(io->pkt);
+	io->pkt = -1;
+	return 1;
+}
+
+/*
+ * Select the transmit backend for the data frames. With CAN_BCM the
+ * frames of a block are handed over with a single TX_SETUP and the
+ * kernel sends them with a fixed interval from a hrtimer. With the
+ * PACKET_TX_RING the frames are put into a mmap'ed ring and the kernel
+ * is kicked once per batch. With io_uring all frames are sent as linked
+ * writes and status requests are linked to their reply read.
+ */
+int canio_set_backend(canio_t *io, int backend)
+{
+	if ((backend == CANIO_BCM) && canio_open_bcm(io))
+		return 1;
+
+	if ((backend == CANIO_RING) && canio_open_ring(io))
+		return 1;
+
+	if ((backend == CANIO_URING) && uring_init(&io->uring, CANIO_URING_ENTRIES))
+		return 1;
+
+	io->backend = backend;
+
+	return 0;
+}
+
+/* CAN_BCM interval between two frames of the length 'dlc' */
+long canio_bcm_ival_us(canio_t *io, int dlc)
+{
+	double rate = io->pace_rate;
+
+	if (!rate)
+		rate = io->bitrate;
+
+	if (!rate)
+		return CANIO_BCM_IVAL_US;
+
+	/* round up to not exceed the bus load */
+	return (long)(canio_frame_bits(dlc) * 1e6 / rate) + 1;
+}
+
+/*
+ * Enable kernel software timestamps for sent and received frames. The tx
+ * timestamps are read from the socket error queue (SOF_TIMESTAMPING_OPT_TSONLY).
+ */
+int canio_set_timestamping(canio_t *io)
+{
+	int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (setsockopt(io->s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		perror("setsockopt SO_TIMESTAMPING");
+		return 1;
+	}
+
+	io->tstamp = 1;
+
+	return 0;
+}
+
+/* get the software timestamp from the control messages - returns 0 on success */
+static int canio_cmsg_tstamp(struct msghdr *msg, struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *tss;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) ||
+		    (cmsg->cmsg_type != SCM_TIMESTAMPING))
+			continue;
+
+		tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+		if (!tss->ts[0].tv_sec && !tss->ts[0].tv_nsec)
+			continue;
+
+		*ts = tss->ts[0];
+		return 0;
+	}
+
+	return 1;
+}
+
+/* fetch the tx timestamp of the last sent frame from the error queue */
+static void canio_tx_tstamp(canio_t *io)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+		  CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+
+		if (recvmsg(io->s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		canio_cmsg_tstamp(&msg, &io->tx_ts);
+	}
+}
+
+/*
+ * Limit the bus load of this socket to 'percent' of the bitrate of the
+ * CAN interface. The bitrate is taken from the netdev via rtnetlink.
+ */
+int canio_set_bus_load(canio_t *io, int percent)
+{
+	if (nl_get_bitrate(io->ifindex, &io->bitrate)) {
+		fprintf(stderr, "unable to read the bitrate of the CAN interface!\n");
+		return 1;
+	}
+
+	io->pace_rate = (double)io->bitrate * percent / 100;
+	io->pace_tokens = CANIO_PACE_BURST * canio_frame_bits(CAN_MAX_DLEN);
+	clock_gettime(CLOCK_MONOTONIC, &io->pace_last);
+
+	return 0;
+}
+
+void canio_close(canio_t *io)
+{
+	uring_exit(&io->uring);
+
+	if (io->ring)
+		munmap(io->ring, CANIO_RING_FRAMES * CANIO_RING_FRAME_SIZE);
+
+	if (io->pkt >= 0)
+		close(io->pkt);
+
+	if (io->bcm >= 0)
+		close(io->bcm);
+
+	if (io->s >= 0)
+		close(io->s);
+
+	io->ring = NULL;
+	io->pkt = -1;
+	io->bcm = -1;
+	io->s = -1;
+}
+
+/* worst case number of bits on the wire for a CAN frame with 11 bit ID */
+int canio_frame_bits(int dlc)
+{
+	/* SOF, ID, RTR, IDE, r0, DLC, data, CRC, CRC/ACK delimiters and ACK */
+	int stuffed = 34 + 8 * dlc;
+
+	/* bit stuffing + EOF and interframe space (not stuffed) */
+	return stuffed + (stuffed - 1) / 4 + 3 + 7 + 3;
+}
+
+/* refill the token bucket with the bits allowed since the last call */
+static void canio_pace_refill(canio_t *io)
+{
+	struct timespec now;
+	double max = CANIO_PACE_BURST * canio_frame_bits(CAN_MAX_DLEN);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	io->pace_tokens += io->pace_rate *
+		((now.tv_sec - io->pace_last.tv_sec) +
+		 (now.tv_nsec - io->pace_last.tv_nsec) / 1e9);
+
+	if (io->pace_tokens > max)
+		io->pace_tokens = max;
+
+	io->pace_last = now;
+}
+
+/* wait for enough tokens and return the number of frames that may be sent */
+static int canio_pace(canio_t *io, struct can_frame *frames, int count)
+{
+	struct timespec ts;
+	double bits, wait;
+	int i;
+
+	canio_pace_refill(io);
+
+	bits = canio_frame_bits(frames[0].can_dlc);
+	if (io->pace_tokens < bits) {
+		wait = (bits - io->pace_tokens) / io->pace_rate;
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+		canio_pace_refill(io);
+	}
+
+	/* at least one frame after waiting for its tokens */
+	for (i = 1; i < count; i++) {
+		bits += canio_frame_bits(frames[i].can_dlc);
+		if (bits > io->pace_tokens)
+			break;
+	}
+
+	return i;
+}
+
+const char *canio_state_name(canio_t *io)
+{
+	switch (io->bus_state) {
+	case CANIO_STATE_ACTIVE:
+		return "error-active";
+	case CANIO_STATE_WARNING:
+		return "error-warning";
+	case CANIO_STATE_PASSIVE:
+		return "error-passive";
+	default:
+		return "bus-off";
+	}
+}
+
+/* update the controller state and error counters from an error frame */
+static void canio_handle_error(canio_t *io, struct can_frame *cf)
+{
+	io->err_frames++;
+
+	if (cf->can_id & CAN_ERR_BUSOFF)
+		io->bus_state = CANIO_STATE_BUSOFF;
+	else if (cf->can_id & CAN_ERR_RESTARTED)
+		io->bus_state = CANIO_STATE_ACTIVE;
+	else if (cf->can_id & CAN_ERR_CRTL) {
+		if (cf->data[1] & (CAN_ERR_CRTL_TX_PASSIVE | CAN_ERR_CRTL_RX_PASSIVE))
+			io->bus_state = CANIO_STATE_PASSIVE;
+		else if (cf->data[1] & (CAN_ERR_CRTL_TX_WARNING | CAN_ERR_CRTL_RX_WARNING))
+			io->bus_state = CANIO_STATE_WARNING;
+		else if (cf->data[1] & CAN_ERR_CRTL_ACTIVE)
+			io->bus_state = CANIO_STATE_ACTIVE;
+	}
+
+	if (cf->can_id & (CAN_ERR_CRTL | CAN_ERR_CNT)) {
+		io->tx_errcnt = cf->data[6];
+		io->rx_errcnt = cf->data[7];
+	}
+}
+
+/* read one frame from the socket - returns 1 for non bootloader frames */
+static int canio_recv(canio_t *io, struct can_frame *frame)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct iovec iov;
+	struct msghdr msg;
+
+	iov.iov_base = frame;
+	iov.iov_len = sizeof(struct can_frame);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	/* poll() may have reported the error queue only */
+	if (recvmsg(io->s, &msg, MSG_DONTWAIT) < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return 1;
+		perror("read");
+		exit(1);
+	}
+
+	if (io->tstamp && canio_cmsg_tstamp(&msg, &io->rx_ts))
+		clock_gettime(CLOCK_REALTIME, &io->rx_ts);
+
+	if (msg.msg_flags & MSG_CONFIRM) {
+		io->tx_confirmed++;
+		return 1;
+	}
+
+	/* frames from other local sockets, e.g. the CAN_BCM data bursts */
+	if (msg.msg_flags & MSG_DONTROUTE)
+		return 1;
+
+	if (frame->can_id & CAN_ERR_FLAG) {
+		canio_handle_error(io, frame);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Process one received frame without consuming bootloader replies which
+ * are kept back for canio_read() - returns 0 on timeout.
+ */
+static int canio_rx_stash(canio_t *io, int timeout_ms)
+{
+	struct can_frame frame;
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = io->s;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0) {
+		perror("poll");
+		exit(1);
+	}
+
+	if (!ret)
+		return 0;
+
+	/* pending tx timestamps in the error queue */
+	if (pfd.revents & POLLERR)
+		canio_tx_tstamp(io);
+
+	if (!(pfd.revents & POLLIN) || canio_recv(io, &frame))
+		return 1;
+
+	if (io->rx_count >= CANIO_RX_BACKLOG) {
+		fprintf(stderr, "rx backlog overflow!\n");
+		exit(1);
+	}
+
+	memcpy(&io->rx_backlog[(io->rx_head + io->rx_count) % CANIO_RX_BACKLOG],
+	       &frame, sizeof(struct can_frame));
+	io->rx_count++;
+
+	return 1;
+}
+
+/* wait for tx confirmations and keep back other received frames */
+static void canio_wait_confirm(canio_t *io)
+{
+	if (!canio_rx_stash(io, CANIO_TX_TIMEOUT_MS)) {
+		fprintf(stderr, "timeout waiting for tx confirmation!\n");
+		exit(1);
+	}
+}
+
+/* wait for the controller to be restarted after bus-off */
+static void canio_wait_restart(canio_t *io)
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (io->bus_state == CANIO_STATE_BUSOFF) {
+		if (elapsed_ms(&start) > CANIO_BUSOFF_TIMEOUT_MS) {
+			fprintf(stderr, "CAN controller did not recover from bus-off!\n");
+			exit(1);
+		}
+
+		canio_rx_stash(io, CANIO_BUSOFF_TIMEOUT_MS / 10);
+	}
+}
+
+/*
+ * Adapt the data transmission to the bus errors seen since the last data
+ * burst: each burst with errors halves the burst size and doubles the gap
+ * between the bursts, each burst without errors reverts one step.
+ */
+static void canio_adapt_level(canio_t *io)
+{
+	/* process pending error frames */
+	while (canio_rx_stash(io, 0))
+		;
+
+	if (io->bus_state == CANIO_STATE_BUSOFF) {
+		io->adapt_level = CANIO_ADAPT_MAX;
+		canio_wait_restart(io);
+	} else if (io->err_frames != io->adapt_errs) {
+		if (io->adapt_level < CANIO_ADAPT_MAX)
+			io->adapt_level++;
+	} else if (io->adapt_level)
+		io->adapt_level--;
+
+	io->adapt_errs = io->err_frames;
+}
+
+/* apply the adaptation level to the next chunk of data frames */
+static int canio_adapt(canio_t *io, int len)
+{
+	int max = CANIO_MAX_BATCH >> io->adapt_level;
+
+	if (!io->adapt_level)
+		return len;
+
+	usleep(CANIO_ADAPT_GAP_US << (io->adapt_level - 1));
+
+	if (max < 1)
+		max = 1;
+
+	return (len > max) ? max : len;
+}
+
+/*
+ * The CAN netdev drops frames with ENOBUFS when its tx queue is full.
+ * Wait for the socket to become writable and give the queue some time to
+ * drain with an exponential backoff before the frames are sent again.
+ */
+static void canio_wait_tx(int fd, struct timespec *stall, int *backoff)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, CANIO_TX_TIMEOUT_MS) < 0) {
+		perror("poll");
+		exit(1);
+	}
+
+	if (elapsed_ms(stall) > CANIO_TX_TIMEOUT_MS) {
+		fprintf(stderr, "timeout waiting for the tx queue to drain!\n");
+		exit(1);
+	}
+
+	usleep(*backoff);
+
+	if (*backoff < CANIO_MAX_BACKOFF_US)
+		*backoff *= 2;
+}
+
+/* send the frames as linked io_uring writes to keep their order */
+static void canio_uring_send(canio_t *io, struct can_frame *frames, int count, int paced)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct timespec stall;
+	int backoff = CANIO_MIN_BACKOFF_US;
+	int batch = io->txqlen;
+	int i, len, done, err;
+	int sent = 0;
+
+	if (batch > io->uring.entries)
+		batch = io->uring.entries;
+	if (batch < 1)
+		batch = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &stall);
+
+	while (sent < count) {
+		len = count - sent;
+		if (len > batch)
+			len = batch;
+
+		if (paced)
+			len = canio_adapt(io, len);
+
+		if (paced && io->pace_rate)
+			len = canio_pace(io, &frames[sent], len);
+
+		for (i = 0; i < len; i++) {
+			sqe = uring_get_sqe(&io->uring);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = io->s;
+			sqe->addr = (unsigned long)&frames[sent + i];
+			sqe->len = sizeof(struct can_frame);
+			sqe->user_data = i;
+			if (i < len - 1)
+				sqe->flags = IOSQE_IO_LINK;
+		}
+
+		if (uring_submit_and_wait(&io->uring, len) < 0)
+			exit(1);
+
+		/* a failed write cancels the rest of the linked writes */
+		done = len;
+		err = 0;
+		for (i = 0; i < len; i++) {
+			if (!uring_get_cqe(&io->uring, &cqe)) {
+				fprintf(stderr, "missing io_uring completion!\n");
+				exit(1);
+			}
+
+			if (cqe.res == sizeof(struct can_frame))
+				continue;
+
+			if (cqe.user_data < done)
+				done = cqe.user_data;
+
+			if (cqe.res != -ECANCELED)
+				err = -cqe.res;
+		}
+
+		if (io->pace_rate) {
+			for (i = 0; i < done; i++)
+				io->pace_tokens -= canio_frame_bits(frames[sent + i].can_dlc);
+		}
+
+		sent += done;
+		io->tx_sent += done;
+
+		if (done == len) {
+			/* progress -> restart stall detection */
+			clock_gettime(CLOCK_MONOTONIC, &stall);
+			backoff = CANIO_MIN_BACKOFF_US;
+			continue;
+		}
+
+		if ((err == ENOBUFS) || (err == EAGAIN)) {
+			canio_wait_tx(io->s, &stall, &backoff);
+			continue;
+		}
+
+		errno = err;
+		perror("io_uring write");
+		exit(1);
+	}
+}
+
+static void canio_send(canio_t *io, struct can_frame *frames, int count, int paced)
+{
+	struct mmsghdr msgs[CANIO_MAX_BATCH];
+	struct iovec iov[CANIO_MAX_BATCH];
+	struct timespec stall;
+	int backoff = CANIO_MIN_BACKOFF_US;
+	int batch = io->txqlen;
+	int i, ret, len, inflight;
+	int sent = 0;
+
+	if (io->backend == CANIO_URING) {
+		canio_uring_send(io, frames, count, paced);
+		return;
+	}
+
+	if (batch > CANIO_MAX_BATCH)
+		batch = CANIO_MAX_BATCH;
+	if (batch < 1)
+		batch = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &stall);
+
+	/* hand the frames to the kernel in chunks of max. 'batch' frames */
+	while (sent < count) {
+		len = count - sent;
+		if (len > batch)
+			len = batch;
+
+		if (io->tx_window) {
+			/* bound the number of unconfirmed frames in the tx path */
+			inflight = io->tx_sent - io->tx_confirmed;
+			if (inflight >= io->tx_window) {
+				canio_wait_confirm(io);
+				continue;
+			}
+
+			if (len > io->tx_window - inflight)
+				len = io->tx_window - inflight;
+		}
+
+		if (paced)
+			len = canio_adapt(io, len);
+
+		/* data frames are paced to the configured bus load */
+		if (paced && io->pace_rate)
+			len = canio_pace(io, &frames[sent], len);
+
+		memset(msgs, 0, len * sizeof(struct mmsghdr));
+		for (i = 0; i < len; i++) {
+			iov[i].iov_base = &frames[sent + i];
+			iov[i].iov_len = sizeof(struct can_frame);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = sendmmsg(io->s, msgs, len, 0);
+		if (ret > 0) {
+			/* all frames consume tokens - commands just skip the wait */
+			if (io->pace_rate) {
+				for (i = 0; i < ret; i++)
+					io->pace_tokens -= canio_frame_bits(frames[sent + i].can_dlc);
+			}
+
+			/* progress -> restart stall detection */
+			sent += ret;
+			io->tx_sent += ret;
+			clock_gettime(CLOCK_MONOTONIC, &stall);
+			backoff = CANIO_MIN_BACKOFF_US;
+			continue;
+		}
+
+		if ((ret < 0) && ((errno == ENOBUFS) || (errno == EAGAIN))) {
+			canio_wait_tx(io->s, &stall, &backoff);
+			continue;
+		}
+
+		perror("sendmmsg");
+		exit(1);
+	}
+}
+
+/* hand the frames to CAN_BCM and wait until the kernel has sent them */
+static void canio_bcm_send(canio_t *io, struct can_frame *frames, int count)
+{
+	struct {
+		struct bcm_msg_head head;
+		struct can_frame frame[CANIO_BCM_MAX_FRAMES];
+	} msg;
+	struct pollfd pfd;
+	long ival;
+	int len, ret;
+	int sent = 0;
+
+	while (sent < count) {
+		len = count - sent;
+		if (len > CANIO_BCM_MAX_FRAMES)
+			len = CANIO_BCM_MAX_FRAMES;
+
+		/* stretch the interval on bus errors */
+		ival = canio_bcm_ival_us(io, frames[sent].can_dlc) << io->adapt_level;
+
+		/* send 'len' frames once with 'ival' and notify when done */
+		memset(&msg.head, 0, sizeof(msg.head));
+		msg.head.opcode = TX_SETUP;
+		msg.head.flags = SETTIMER | STARTTIMER | TX_COUNTEVT;
+		msg.head.count = len;
+		msg.head.ival1.tv_sec = ival / 1000000;
+		msg.head.ival1.tv_usec = ival % 1000000;
+		msg.head.can_id = CAN_ID;
+		msg.head.nframes = len;
+		memcpy(msg.frame, &frames[sent], len * sizeof(struct can_frame));
+
+		if (write(io->bcm, &msg, sizeof(msg.head) + len * sizeof(struct can_frame)) < 0) {
+			perror("bcm write");
+			exit(1);
+		}
+
+		/* wait for the TX_EXPIRED notification */
+		pfd.fd = io->bcm;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, len * ival / 1000 + CANIO_TX_TIMEOUT_MS);
+		if (ret < 0) {
+			perror("poll");
+			exit(1);
+		}
+
+		if (!ret) {
+			fprintf(stderr, "timeout in CAN_BCM block transfer!\n");
+			exit(1);
+		}
+
+		if (read(io->bcm, &msg, sizeof(msg)) < 0) {
+			perror("bcm read");
+			exit(1);
+		}
+
+		if (msg.head.opcode != TX_EXPIRED) {
+			fprintf(stderr, "unexpected CAN_BCM opcode %d!\n", msg.head.opcode);
+			exit(1);
+		}
+
+		/* remove the expired tx job */
+		memset(&msg.head, 0, sizeof(msg.head));
+		msg.head.opcode = TX_DELETE;
+		msg.head.can_id = CAN_ID;
+
+		if (write(io->bcm, &msg.head, sizeof(msg.head)) < 0) {
+			perror("bcm write");
+			exit(1);
+		}
+
+		sent += len;
+		io->tx_sent += len;
+	}
+}
+
+/* put the frames into the PACKET_TX_RING and kick the kernel per batch */
+static void canio_ring_send(canio_t *io, struct can_frame *frames, int count)
+{
+	struct tpacket2_hdr *hdr;
+	struct timespec stall;
+	int backoff = CANIO_MIN_BACKOFF_US;
+	int batch = io->txqlen;
+	int i, len;
+	int sent = 0;
+
+	if (batch > CANIO_RING_FRAMES)
+		batch = CANIO_RING_FRAMES;
+	if (batch < 1)
+		batch = 1;
+
+	while (sent < count) {
+		len = count - sent;
+		if (len > batch)
+			len = batch;
+
+		len = canio_adapt(io, len);
+
+		if (io->pace_rate)
+			len = canio_pace(io, &frames[sent], len);
+
+		for (i = 0; i < len; i++) {
+			hdr = (struct tpacket2_hdr *)((char *)io->ring +
+						      io->ring_head * CANIO_RING_FRAME_SIZE);
+
+			if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+				fprintf(stderr, "PACKET_TX_RING frame not available (status 0x%X)!\n",
+					hdr->tp_status);
+				exit(1);
+			}
+
+			/* frame data is located behind the (aligned) tpacket2_hdr */
+			memcpy((char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll),
+			       &frames[sent + i], sizeof(struct can_frame));
+			hdr->tp_len = sizeof(struct can_frame);
+			hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+			io->ring_head = (io->ring_head + 1) % CANIO_RING_FRAMES;
+		}
+
+		/* blocking kick returns when all requested frames are sent */
+		clock_gettime(CLOCK_MONOTONIC, &stall);
+		while (send(io->pkt, NULL, 0, 0) < 0) {
+			if ((errno != ENOBUFS) && (errno != EAGAIN)) {
+				perror("PACKET_TX_RING send");
+				exit(1);
+			}
+
+			/* remaining frames are still marked for sending */
+			canio_wait_tx(io->pkt, &stall, &backoff);
+		}
+		backoff = CANIO_MIN_BACKOFF_US;
+
+		if (io->pace_rate) {
+			for (i = 0; i < len; i++)
+				io->pace_tokens -= canio_frame_bits(frames[sent + i].can_dlc);
+		}
+
+		sent += len;
+		io->tx_sent += len;
+	}
+}
+
+/* bootloader commands are sent without waiting for the bus load pacing */
+void canio_write(canio_t *io, struct can_frame *frames, int count)
+{
+	canio_send(io, frames, count, 0);
+}
+
+void canio_write_data(canio_t *io, struct can_frame *frames, int count)
+{
+	struct timespec start, end;
+
+	canio_adapt_level(io);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (io->backend == CANIO_BCM)
+		canio_bcm_send(io, frames, count);
+	else if (io->backend == CANIO_RING)
+		canio_ring_send(io, frames, count);
+	else
+		canio_send(io, frames, count, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* transfer statistics to compare the transmit backends */
+	io->data_frames += count;
+	io->data_ns += ts_diff_ns(&start, &end);
+
+	if (count)
+		canio_stat_add(&io->burst_stat, ts_diff_ns(&start, &end) / 1000.0 / count);
+}
+
+/* returns 1 when a frame has been received and 0 on timeout */
+int canio_read(canio_t *io, struct can_frame *frame, int timeout_ms)
+{
+	struct timespec start;
+	struct pollfd pfd;
+	long remaining;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+
+		/* frames kept back while waiting for tx confirmations */
+		if (io->rx_count) {
+			memcpy(frame, &io->rx_backlog[io->rx_head],
+			       sizeof(struct can_frame));
+			io->rx_head = (io->rx_head + 1) % CANIO_RX_BACKLOG;
+			io->rx_count--;
+			return 1;
+		}
+
+		remaining = timeout_ms - elapsed_ms(&start);
+		if (remaining < 0)
+			remaining = 0;
+
+		pfd.fd = io->s;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, remaining);
+		if (ret < 0) {
+			perror("poll");
+			exit(1);
+		}
+
+		if (!ret)
+			return 0;
+
+		/* pending tx timestamps in the error queue */
+		if (pfd.revents & POLLERR)
+			canio_tx_tstamp(io);
+
+		/* skip own tx confirmations */
+		if ((pfd.revents & POLLIN) && !canio_recv(io, frame))
+			return 1;
+	}
+}
+
+/*
+ * Send the request and read the reply as linked io_uring operations which
+ * are guarded by a linked timeout - returns 0 on timeout.
+ */
+static int canio_uring_request(canio_t *io, struct can_frame *req,
+			       struct can_frame *reply, int timeout_ms)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct msghdr msg;
+	struct iovec iov;
+	int wres = 0, rres = 0;
+	int i;
+
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(struct can_frame);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+	sqe = uring_get_sqe(&io->uring);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = io->s;
+	sqe->addr = (unsigned long)req;
+	sqe->len = sizeof(struct can_frame);
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 0;
+
+	sqe = uring_get_sqe(&io->uring);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = io->s;
+	sqe->addr = (unsigned long)&msg;
+	sqe->len = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 1;
+
+	sqe = uring_get_sqe(&io->uring);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (unsigned long)&ts;
+	sqe->len = 1;
+	sqe->user_data = 2;
+
+	if (uring_submit_and_wait(&io->uring, 3) < 0)
+		exit(1);
+
+	for (i = 0; i < 3; i++) {
+		if (!uring_get_cqe(&io->uring, &cqe)) {
+			fprintf(stderr, "missing io_uring completion!\n");
+			exit(1);
+		}
+
+		if (cqe.user_data == 0)
+			wres = cqe.res;
+		else if (cqe.user_data == 1)
+			rres = cqe.res;
+	}
+
+	/* e.g. full tx queue -> take the path with backpressure handling */
+	if (wres != sizeof(struct can_frame)) {
+		canio_write(io, req, 1);
+		return canio_read(io, reply, timeout_ms);
+	}
+
+	io->tx_sent++;
+
+	/* the read has been canceled by the linked timeout */
+	if ((rres == -ECANCELED) || (rres == -ETIME))
+		return 0;
+
+	if (rres < 0) {
+		errno = -rres;
+		perror("io_uring recvmsg");
+		exit(1);
+	}
+
+	/* locally sent frames are no replies */
+	if (msg.msg_flags & (MSG_CONFIRM | MSG_DONTROUTE))
+		return canio_read(io, reply, timeout_ms);
+
+	if (reply->can_id & CAN_ERR_FLAG) {
+		canio_handle_error(io, reply);
+		return canio_read(io, reply, timeout_ms);
+	}
+
+	if (io->tstamp && canio_cmsg_tstamp(&msg, &io->rx_ts))
+		clock_gettime(CLOCK_REALTIME, &io->rx_ts);
+
+	return 1;
+}
+
+/* send a request and read the next frame - returns 0 on timeout */
+int canio_exchange(canio_t *io, struct can_frame *req, struct can_frame *reply,
+		   int timeout_ms)
+{
+	if (io->backend == CANIO_URING)
+		return canio_uring_request(io, req, reply, timeout_ms);
+
+	canio_write(io, req, 1);
+	return canio_read(io, reply, timeout_ms);
+}
+
+/* send a request and read the reply - returns 0 on timeout */
+int canio_request(canio_t *io, struct can_frame *req, struct can_frame *reply,
+		  int timeout_ms)
+{
+	struct timespec start, end;
+	unsigned long err_frames;
+	int ret, retry;
+
+	for (retry = 0; ; retry++) {
+
+		err_frames = io->err_frames;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* user space fallback when the netdev provides no tx timestamp */
+		if (io->tstamp) {
+			canio_tx_tstamp(io);
+			clock_gettime(CLOCK_REALTIME, &io->tx_ts);
+		}
+
+		ret = canio_exchange(io, req, reply, timeout_ms);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (ret) {
+			canio_stat_add(&io->rtt_stat, ts_diff_ns(&start, &end) / 1000.0);
+			if (io->tstamp)
+				canio_tx_tstamp(io);
+			break;
+		}
+
+		/* repeat the request when the reply got lost by bus errors */
+		if ((io->err_frames == err_frames) || (retry >= CANIO_ERR_RETRIES))
+			break;
+
+		if (io->bus_state == CANIO_STATE_BUSOFF)
+			canio_wait_restart(io);
+	}
+
+	return ret;
+}
+
+void canio_stat_add(canio_stat_t *st, double val)
+{
+	if (!st->count || (val < st->min))
+		st->min = val;
+
+	if (!st->count || (val > st->max))
+		st->max = val;
+
+	st->sum += val;
+	st->count++;
+}
+
+void canio_stat_print(const char *name, canio_stat_t *st)
+{
+	if (!st->count)
+		return;
+
+	printf("%s (%lu) min/avg/max %.1f/%.1f/%.1f us (jitter %.1f us)\n",
+	       name, st->count, st->min, st->sum / st->count, st->max, st->max - st->min);
+}
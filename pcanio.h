@@ -0,0 +1,153 @@
+/*
+ * pcanio.h - CAN I/O layer for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANIOH__
+#define __PCANIOH__
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/can.h>
+
+#include "pcanuring.h"
+
+/* max. number of frames handed to the kernel with one sendmmsg() call */
+#define CANIO_MAX_BATCH 128
+
+/* give up when the tx queue does not drain within this time */
+#define CANIO_TX_TIMEOUT_MS 3000
+
+/* backoff boundaries while waiting for the tx queue to drain */
+#define CANIO_MIN_BACKOFF_US 100
+#define CANIO_MAX_BACKOFF_US 10000
+
+/* token bucket depth for the bus load pacing (frames) */
+#define CANIO_PACE_BURST 4
+
+/* transmit backends for the data frames */
+#define CANIO_RAW 0
+#define CANIO_BCM 1
+#define CANIO_RING 2
+#define CANIO_URING 3
+
+/* io_uring submission queue entries */
+#define CANIO_URING_ENTRIES 128
+
+/* max. frames in one CAN_BCM TX_SETUP (MAX_NFRAMES in the kernel) */
+#define CANIO_BCM_MAX_FRAMES 256
+
+/* CAN_BCM frame interval when the bitrate is unknown */
+#define CANIO_BCM_IVAL_US 250
+
+/* PACKET_TX_RING geometry (frame slots hold tpacket2_hdr + can_frame) */
+#define CANIO_RING_FRAMES 256
+#define CANIO_RING_FRAME_SIZE 64
+#define CANIO_RING_BLOCK_SIZE 4096
+
+/* CAN controller states derived from the error frames */
+#define CANIO_STATE_ACTIVE 0
+#define CANIO_STATE_WARNING 1
+#define CANIO_STATE_PASSIVE 2
+#define CANIO_STATE_BUSOFF 3
+
+/* adaptive data transmission: max. backoff level and gap at level 1 */
+#define CANIO_ADAPT_MAX 6
+#define CANIO_ADAPT_GAP_US 250
+
+/* time for the CAN controller to recover from bus-off */
+#define CANIO_BUSOFF_TIMEOUT_MS 5000
+
+/* status requests repeated when the reply got lost by bus errors */
+#define CANIO_ERR_RETRIES 2
+
+/* received frames kept back while waiting for tx confirmations */
+#define CANIO_RX_BACKLOG 16
+
+typedef struct {
+	unsigned long count;
+	double min;
+	double max;
+	double sum;
+} canio_stat_t;
+
+typedef struct {
+	int s;		/* CAN_RAW socket */
+	int bcm;	/* CAN_BCM socket (-1 = unused) */
+	int pkt;	/* AF_PACKET socket (-1 = unused) */
+	void *ring;	/* mmap'ed PACKET_TX_RING */
+	int ring_head;
+	uring_t uring;	/* io_uring instance (fd -1 = unused) */
+	int backend;	/* transmit backend for data frames */
+	int ifindex;
+	int txqlen;	/* netdev tx queue length (frames) */
+	int tx_window;	/* max. unconfirmed frames (0 = no tx confirmation) */
+	unsigned long tx_sent;
+	unsigned long tx_confirmed;
+	unsigned long data_frames;
+	long long data_ns;	/* time spent in data frame transfers */
+	int bus_state;		/* CAN controller state (CANIO_STATE_*) */
+	uint8_t tx_errcnt;
+	uint8_t rx_errcnt;
+	unsigned long err_frames;
+	unsigned long rx_stale;		/* late replies to previous commands */
+	unsigned long rx_unexpected;	/* frames nobody waited for */
+	unsigned long rto_retries;	/* repeated status requests */
+	unsigned long block_retries;	/* repeated block transfers */
+	unsigned long adapt_errs;	/* err_frames at the last data burst */
+	int adapt_level;	/* data transmission backoff (0 = full speed) */
+	int tstamp;		/* SO_TIMESTAMPING enabled */
+	struct timespec tx_ts;	/* tx timestamp of the last request */
+	struct timespec rx_ts;	/* rx timestamp of the last received frame */
+	canio_stat_t burst_stat;	/* data burst time per frame (us) */
+	canio_stat_t rtt_stat;		/* status request round trip time (us) */
+	uint32_t bitrate;	/* CAN bitrate (0 = unknown) */
+	double pace_rate;	/* allowed bits per second (0 = no pacing) */
+	double pace_tokens;	/* token bucket content in bits */
+	struct timespec pace_last;
+	int rx_head;
+	int rx_count;
+	struct can_frame rx_backlog[CANIO_RX_BACKLOG];
+} canio_t;
+
+int canio_open(canio_t *io, const char *ifname);
+void canio_close(canio_t *io);
+int canio_set_tx_window(canio_t *io, int window);
+int canio_set_timestamping(canio_t *io);
+int canio_set_bus_load(canio_t *io, int percent);
+int canio_set_backend(canio_t *io, int backend);
+long canio_bcm_ival_us(canio_t *io, int dlc);
+int canio_frame_bits(int dlc);
+void canio_write(canio_t *io, struct can_frame *frames, int count);
+void canio_write_data(canio_t *io, struct can_frame *frames, int count);
+int canio_read(canio_t *io, struct can_frame *frame, int timeout_ms);
+int canio_exchange(canio_t *io, struct can_frame *req, struct can_frame *reply,
+		   int timeout_ms);
+int canio_request(canio_t *io, struct can_frame *req, struct can_frame *reply,
+		  int timeout_ms);
+const char *canio_state_name(canio_t *io);
+void canio_stat_add(canio_stat_t *st, double val);
+void canio_stat_print(const char *name, canio_stat_t *st);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * pcanjrnl.c - resume journal for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "pcanjrnl.h"
+
+/* FNV-1a hash parameters */
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+uint64_t jrnl_hash(FILE *infile)
+{
+	uint64_t hash = FNV_OFFSET;
+	uint8_t buf[4096];
+	size_t len, i;
+
+	rewind(infile);
+	while ((len = fread(buf, 1, sizeof(buf), infile)) > 0) {
+		for (i = 0; i < len; i++) {
+			hash ^= buf[i];
+			hash *= FNV_PRIME;
+		}
+	}
+	rewind(infile);
+
+	return hash;
+}
+
+static void jrnl_list_add(jrnl_list_t *list, uint32_t addr, uint32_t len)
+{
+	if (list->count == list->size) {
+		list->size = (list->size) ? list->size * 2 : 64;
+		list->range = realloc(list->range, list->size * sizeof(jrnl_range_t));
+		if (!list->range) {
+			perror("journal records");
+			exit(1);
+		}
+	}
+
+	list->range[list->count].addr = addr;
+	list->range[list->count].len = len;
+	list->count++;
+}
+
+/* remove the records which overlap the range */
+static void jrnl_list_drop(jrnl_list_t *list, uint32_t addr, uint32_t len)
+{
+	int i, n;
+
+	for (i = 0, n = 0; i < list->count; i++) {
+		if (((uint64_t)list->range[i].addr + list->range[i].len > addr) &&
+		    ((uint64_t)addr + len > list->range[i].addr))
+			continue;
+
+		list->range[n++] = list->range[i];
+	}
+
+	list->count = n;
+}
+
+static void jrnl_invalidate(jrnl_t *jr, uint32_t addr, uint32_t len)
+{
+	jrnl_list_drop(&jr->erased, addr, len);
+	jrnl_list_drop(&jr->blocks, addr, len);
+	jrnl_list_drop(&jr->sectors, addr, len);
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const jrnl_range_t *ra = a;
+	const jrnl_range_t *rb = b;
+
+	if (ra->addr != rb->addr)
+		return (ra->addr < rb->addr) ? -1 : 1;
+
+	return 0;
+}
+
+static int jrnl_contains(jrnl_range_t *range, uint32_t addr, uint32_t len)
+{
+	return (range->addr <= addr) &&
+		((uint64_t)addr + len <= (uint64_t)range->addr + range->len);
+}
+
+static void jrnl_free(jrnl_t *jr)
+{
+	free(jr->erased.range);
+	free(jr->blocks.range);
+	free(jr->sectors.range);
+	memset(&jr->erased, 0, sizeof(jrnl_list_t));
+	memset(&jr->blocks, 0, sizeof(jrnl_list_t));
+	memset(&jr->sectors, 0, sizeof(jrnl_list_t));
+	jr->records = 0;
+}
+
+/* read the records of an interrupted run - returns the length of the valid content */
+static long jrnl_load(jrnl_t *jr, const char *header)
+{
+	char line[80];
+	long valid = 0;
+	unsigned int addr, len;
+	char type;
+	FILE *fp;
+
+	fp = fopen(jr->path, "r");
+	if (!fp)
+		return 0;
+
+	if (!fgets(line, sizeof(line), fp) || strcmp(line, header)) {
+		fclose(fp);
+		return 0;
+	}
+	valid = ftell(fp);
+
+	/* a torn line at the end was not completely written */
+	while (fgets(line, sizeof(line), fp) && strchr(line, '\n')) {
+
+		if (sscanf(line, "%c %X %X", &type, &addr, &len) != 3)
+			break;
+
+		if (type == JRNL_ERASED)
+			jrnl_list_add(&jr->erased, addr, len);
+		else if (type == JRNL_BLOCK)
+			jrnl_list_add(&jr->blocks, addr, len);
+		else if (type == JRNL_SECTOR)
+			jrnl_list_add(&jr->sectors, addr, len);
+		else if (type == JRNL_INVALID)
+			jrnl_invalidate(jr, addr, len);
+		else
+			break;
+
+		jr->records++;
+		valid = ftell(fp);
+	}
+
+	fclose(fp);
+
+	qsort(jr->blocks.range, jr->blocks.count, sizeof(jrnl_range_t), cmp_range);
+
+	return valid;
+}
+
+int jrnl_open(jrnl_t *jr, const char *dir, const char *ifname,
+	      uint8_t module_id, uint64_t hash)
+{
+	char header[80];
+	long valid;
+
+	memset(jr, 0, sizeof(jrnl_t));
+	jr->fd = -1;
+
+	snprintf(jr->path, sizeof(jr->path), "%s/pcanflash-%s-%02d-%016llX.jrnl",
+		 dir, ifname, module_id, (unsigned long long)hash);
+	snprintf(header, sizeof(header), "pcanflash journal %s %d %016llX\n",
+		 ifname, module_id, (unsigned long long)hash);
+
+	valid = jrnl_load(jr, header);
+
+	jr->fd = open(jr->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (jr->fd < 0) {
+		perror("open journal");
+		jrnl_free(jr);
+		return 1;
+	}
+
+	jr->header_len = strlen(header);
+
+	/* cut off a torn record or start a new journal */
+	if (ftruncate(jr->fd, valid)) {
+		perror("truncate journal");
+		return 1;
+	}
+
+	if (!valid) {
+		if ((write(jr->fd, header, jr->header_len) != jr->header_len) ||
+		    fsync(jr->fd)) {
+			perror("write journal");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* forget the records of the interrupted run */
+void jrnl_reset(jrnl_t *jr)
+{
+	jrnl_free(jr);
+
+	if ((jr->fd >= 0) && (ftruncate(jr->fd, jr->header_len) || fsync(jr->fd)))
+		perror("reset journal");
+}
+
+int jrnl_erased(jrnl_t *jr, uint32_t addr, uint32_t len)
+{
+	int i;
+
+	for (i = 0; i < jr->erased.count; i++) {
+		if (jrnl_contains(&jr->erased.range[i], addr, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+int jrnl_done(jrnl_t *jr, uint32_t addr, uint32_t len)
+{
+	int lo = 0, hi = jr->blocks.count - 1, mid;
+	int i;
+
+	/* last block record which starts at or before addr */
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (jr->blocks.range[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	if ((hi >= 0) && jrnl_contains(&jr->blocks.range[hi], addr, len))
+		return 1;
+
+	for (i = 0; i < jr->sectors.count; i++) {
+		if (jrnl_contains(&jr->sectors.range[i], addr, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+void jrnl_add(jrnl_t *jr, char type, uint32_t addr, uint32_t len)
+{
+	if (jr->fd < 0)
+		return;
+
+	/* the blocks of an erased sector have to be written again */
+	if (type == JRNL_INVALID)
+		jrnl_invalidate(jr, addr, len);
+
+	if (dprintf(jr->fd, "%c %06X %X\n", type, addr, len) < 0) {
+		perror("write journal");
+		return;
+	}
+
+	/* the programmed blocks rely on the erase of their sector */
+	if ((type == JRNL_ERASED) || (type == JRNL_INVALID) || (++jr->unsynced >= JRNL_SYNC_RECORDS)) {
+		if (fsync(jr->fd))
+			perror("sync journal");
+		jr->unsynced = 0;
+	}
+}
+
+/* remove the journal of a completely written image */
+void jrnl_close(jrnl_t *jr, int complete)
+{
+	if (jr->fd < 0)
+		return;
+
+	if (complete) {
+		if (unlink(jr->path))
+			perror("remove journal");
+	} else if (fsync(jr->fd))
+		perror("sync journal");
+
+	close(jr->fd);
+	jr->fd = -1;
+	jrnl_free(jr);
+}
@@ -0,0 +1,83 @@
+/*
+ * pcanjrnl.h - resume journal for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANJRNLH__
+#define __PCANJRNLH__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+/*
+ * The journal of a flashing process is a text file which is named after
+ * the interface, the module id and the hash of the image. Each erased
+ * sector and each verified block or sector is appended as one line and
+ * the file is synced after JRNL_SYNC_RECORDS lines, so a power loss only
+ * forgets the last few blocks. Before a sector is erased an invalidation
+ * record drops the former records of its range. The journal is removed
+ * after the image has been completely written.
+ */
+#define JRNL_SYNC_RECORDS 16
+
+/* record types */
+#define JRNL_ERASED	'E'	/* sector erased */
+#define JRNL_BLOCK	'B'	/* block programmed and verified */
+#define JRNL_SECTOR	'S'	/* sector content verified */
+#define JRNL_INVALID	'I'	/* sector is erased again */
+
+typedef struct {
+	uint32_t addr;
+	uint32_t len;
+} jrnl_range_t;
+
+typedef struct {
+	int count;
+	int size;
+	jrnl_range_t *range;
+} jrnl_list_t;
+
+typedef struct {
+	int fd;
+	char path[PATH_MAX];
+	long header_len;
+	int unsynced;
+	/* records of the interrupted run */
+	int records;
+	jrnl_list_t erased;
+	jrnl_list_t blocks;
+	jrnl_list_t sectors;
+} jrnl_t;
+
+uint64_t jrnl_hash(FILE *infile);
+int jrnl_open(jrnl_t *jr, const char *dir, const char *ifname,
+	      uint8_t module_id, uint64_t hash);
+void jrnl_reset(jrnl_t *jr);
+int jrnl_erased(jrnl_t *jr, uint32_t addr, uint32_t len);
+int jrnl_done(jrnl_t *jr, uint32_t addr, uint32_t len);
+void jrnl_add(jrnl_t *jr, char type, uint32_t addr, uint32_t len);
+void jrnl_close(jrnl_t *jr, int complete);
+
+#endif
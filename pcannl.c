@@ -0,0 +1,228 @@
+/*
+ * pcannl.c - rtnetlink helpers for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/can/netlink.h>
+
+#include "pcannl.h"
+
+#define NL_BUF_LEN 8192
+
+/* find attribute 'type' in a (nested) attribute stream */
+static struct rtattr *nl_find_attr(struct rtattr *rta, int len, int type)
+{
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == type)
+			return rta;
+	}
+
+	return NULL;
+}
+
+/* request the link information of a netdev - returns the payload length */
+static int nl_get_link(int ifindex, char *buf, int buflen, struct ifinfomsg **ifi)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+	} req;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	int fd, len;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		perror("netlink socket");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.i.ifi_family = AF_UNSPEC;
+	req.i.ifi_index = ifindex;
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0) {
+		perror("netlink send");
+		close(fd);
+		return -1;
+	}
+
+	len = recv(fd, buf, buflen, 0);
+	close(fd);
+
+	if (len < 0) {
+		perror("netlink recv");
+		return -1;
+	}
+
+	if (!NLMSG_OK(nlh, len) || (nlh->nlmsg_type != RTM_NEWLINK))
+		return -1;
+
+	*ifi = NLMSG_DATA(nlh);
+
+	return IFLA_PAYLOAD(nlh);
+}
+
+int nl_get_bitrate(int ifindex, uint32_t *bitrate)
+{
+	char buf[NL_BUF_LEN];
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	struct can_bittiming *bt;
+	int len;
+
+	len = nl_get_link(ifindex, buf, sizeof(buf), &ifi);
+	if (len < 0)
+		return 1;
+
+	/* IFLA_LINKINFO -> IFLA_INFO_DATA -> IFLA_CAN_BITTIMING */
+	rta = nl_find_attr(IFLA_RTA(ifi), len, IFLA_LINKINFO);
+	if (!rta)
+		return 1;
+
+	rta = nl_find_attr(RTA_DATA(rta), RTA_PAYLOAD(rta), IFLA_INFO_DATA);
+	if (!rta)
+		return 1;
+
+	rta = nl_find_attr(RTA_DATA(rta), RTA_PAYLOAD(rta), IFLA_CAN_BITTIMING);
+	if (!rta || (RTA_PAYLOAD(rta) < sizeof(struct can_bittiming)))
+		return 1;
+
+	bt = RTA_DATA(rta);
+	if (!bt->bitrate)
+		return 1;
+
+	*bitrate = bt->bitrate;
+
+	return 0;
+}
+
+/* dropped and failed transmissions of the netdev (IFLA_STATS64) */
+int nl_get_tx_dropped(int ifindex, uint64_t *dropped)
+{
+	char buf[NL_BUF_LEN];
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	struct rtnl_link_stats64 stats;
+	int len;
+
+	len = nl_get_link(ifindex, buf, sizeof(buf), &ifi);
+	if (len < 0)
+		return 1;
+
+	rta = nl_find_attr(IFLA_RTA(ifi), len, IFLA_STATS64);
+	if (!rta)
+		return 1;
+
+	/* the struct grows with the kernel versions and the attribute
+	 * payload is not necessarily 64 bit aligned
+	 */
+	memset(&stats, 0, sizeof(stats));
+	len = RTA_PAYLOAD(rta);
+	if (len > sizeof(stats))
+		len = sizeof(stats);
+	memcpy(&stats, RTA_DATA(rta), len);
+	*dropped = stats.tx_dropped + stats.tx_errors;
+
+	return 0;
+}
+
+/* list the CAN netdevs which are up - returns the number of netdevs */
+int nl_get_can_links(int *ifindex, char (*ifname)[IF_NAMESIZE], int max)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+	} req;
+	char buf[NL_BUF_LEN];
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int fd, len, count = 0;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		perror("netlink socket");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.i.ifi_family = AF_UNSPEC;
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0) {
+		perror("netlink send");
+		close(fd);
+		return -1;
+	}
+
+	/* the dump is split into several messages until NLMSG_DONE */
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			perror("netlink recv");
+			close(fd);
+			return -1;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if ((nlh->nlmsg_type == NLMSG_DONE) || (nlh->nlmsg_type == NLMSG_ERROR)) {
+				close(fd);
+				return count;
+			}
+
+			if (nlh->nlmsg_type != RTM_NEWLINK)
+				continue;
+
+			ifi = NLMSG_DATA(nlh);
+			if ((ifi->ifi_type != ARPHRD_CAN) || !(ifi->ifi_flags & IFF_UP))
+				continue;
+
+			rta = nl_find_attr(IFLA_RTA(ifi), IFLA_PAYLOAD(nlh), IFLA_IFNAME);
+			if (!rta || (count == max))
+				continue;
+
+			ifindex[count] = ifi->ifi_index;
+			memset(ifname[count], 0, IF_NAMESIZE);
+			strncpy(ifname[count], RTA_DATA(rta), IF_NAMESIZE - 1);
+			count++;
+		}
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * pcannl.h - rtnetlink helpers for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANNLH__
+#define __PCANNLH__
+
+#include <stdint.h>
+#include <net/if.h>
+
+int nl_get_bitrate(int ifindex, uint32_t *bitrate);
+int nl_get_tx_dropped(int ifindex, uint64_t *dropped);
+int nl_get_can_links(int *ifindex, char (*ifname)[IF_NAMESIZE], int max);
+
+#endif
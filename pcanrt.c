@@ -0,0 +1,138 @@
+/*
+ * pcanrt.c - real-time mode for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "pcanrt.h"
+
+static int rt_active;
+static int old_policy;
+static struct sched_param old_param;
+static cpu_set_t old_cpus;
+
+/* touch the stack pages once to avoid page faults in the time critical path */
+static void rt_prefault_stack(void)
+{
+	volatile unsigned char stack[RT_PREFAULT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+void rt_prefault(void *buf, size_t len)
+{
+	volatile unsigned char *ptr = buf;
+	size_t i;
+
+	for (i = 0; i < len; i += 4096)
+		ptr[i] = ptr[i];
+}
+
+/* read every page of the file once so that it is in the page cache */
+void rt_preload(int fd)
+{
+	char buf[4096];
+	off_t pos = 0;
+	ssize_t ret;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	while ((ret = pread(fd, buf, sizeof(buf), pos)) > 0)
+		pos += ret;
+}
+
+/*
+ * Lock all current and future memory, pin the process to 'cpu' and run it
+ * with SCHED_FIFO priority 'prio' (0 = keep the scheduling policy).
+ * The original settings are restored by rt_restore() which is also
+ * registered to be called at exit.
+ */
+int rt_enable(int prio, int cpu)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	old_policy = sched_getscheduler(0);
+	if ((old_policy < 0) || sched_getparam(0, &old_param) ||
+	    sched_getaffinity(0, sizeof(old_cpus), &old_cpus)) {
+		perror("get scheduling parameters");
+		return 1;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("mlockall");
+		return 1;
+	}
+
+	rt_active = 1;
+	atexit(rt_restore);
+
+	rt_prefault_stack();
+
+	if (cpu != RT_NO_CPU) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+	}
+
+	if (prio) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = prio;
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+			perror("sched_setscheduler");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void rt_restore(void)
+{
+	if (!rt_active)
+		return;
+
+	rt_active = 0;
+
+	sched_setscheduler(0, old_policy, &old_param);
+	sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+	munlockall();
+}
@@ -0,0 +1,42 @@
+/*
+ * pcanrt.h - real-time mode for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANRTH__
+#define __PCANRTH__
+
+#include <stddef.h>
+
+/* stack area which is pre-faulted when entering the real-time mode */
+#define RT_PREFAULT_STACK (512 * 1024)
+
+#define RT_NO_CPU -1
+
+int rt_enable(int prio, int cpu);
+void rt_prefault(void *buf, size_t len);
+void rt_preload(int fd);
+void rt_restore(void);
+
+#endif
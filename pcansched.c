@@ -0,0 +1,223 @@
+/*
+ * pcansched.c - interleaved flashing of modules for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pcanhw.h"
+#include "pcansched.h"
+#include "pcanwork.h"
+
+/* start the next transfer of the current block - returns 0 when the
+ * block is completely written
+ */
+static int job_transfer(job_t *job)
+{
+	flash_t *fl = job->fl;
+	uint32_t offset = job->boffset + get_flash_offset(fl->hw_type);
+	int i;
+
+	while (job->pos < job->blksz) {
+
+		job->len = job->blksz - job->pos;
+		if (job->len > fl->xfer_size)
+			job->len = fl->xfer_size;
+
+		/* skip empty parts of a split block */
+		for (i = 0; i < job->len; i++) {
+			if (job->buf[job->pos + i] != EMPTY)
+				break;
+		}
+		if (i == job->len) {
+			job->pos += job->len;
+			continue;
+		}
+
+		sess_init(&job->sess, fl->io, fl->module_id, fl->dry_run);
+		sess_set_flags(&job->sess, fl->hw_type, fl->flags);
+		sess_set_retries(&job->sess, fl->retries);
+		if (sess_write(&job->sess, offset + job->pos, job->len, job->buf + job->pos,
+			       fl->alternating_xor_flip, fl->ftd_len))
+			return -1;
+
+		printf("module id %d: writing non empty block at offset 0x%X with csum 0x%04X\n",
+		       fl->module_id, (unsigned int)(offset + job->pos),
+		       (unsigned int)job->sess.csum);
+
+		job->pos += job->len;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* start the next session of the job - returns 0 when nothing is left */
+static int job_next(job_t *job)
+{
+	flash_t *fl = job->fl;
+	const fblock_t *fblock;
+	uint32_t crc_start = get_crc_startpos(fl->hw_type);
+	int ret, i;
+
+	while (job->phase == JOB_ERASE) {
+		if (job->sector == get_num_flashblocks(fl->hw_type)) {
+			job->phase = JOB_WRITE;
+			job->foffset = get_file_skip(fl->hw_type);
+			job->blksz = fl->xfer_size;
+			job->pos = job->blksz;
+			break;
+		}
+
+		i = job->sector++;
+		if (!flashblock_used(job->infile, fl->hw_type, i))
+			continue;
+
+		fblock = &get_hw(fl->hw_type)->flashblocks[i];
+		printf("module id %d: erasing block at startaddr 0x%06X with block size 0x%06X\n",
+		       fl->module_id, (unsigned int)fblock->start, (unsigned int)fblock->len);
+
+		sess_init(&job->sess, fl->io, fl->module_id, fl->dry_run);
+		sess_set_flags(&job->sess, fl->hw_type, fl->flags);
+		sess_erase(&job->sess, fblock->start, fblock->len);
+		return 1;
+	}
+
+	while (job->phase == JOB_WRITE) {
+
+		/* rest of the current block */
+		ret = job_transfer(job);
+		if (ret)
+			return ret;
+
+		if (fseek(job->infile, job->foffset, SEEK_SET))
+			break;
+
+		memset(job->buf, EMPTY, job->blksz);
+		if (!fread(job->buf, 1, job->blksz, job->infile))
+			break;
+
+		job->boffset = job->foffset;
+		job->foffset += job->blksz;
+
+		for (i = 0; i < job->blksz; i++) {
+			if (job->buf[i] != EMPTY)
+				break;
+		}
+
+		/* empty block (all bytes are EMPTY / 0xFFU) -> no action */
+		if (i == job->blksz)
+			continue;
+
+		/* check whether we need to patch the CRC array */
+		if ((crc_start) && (crc_start >= job->boffset) &&
+		    (crc_start < job->boffset + job->blksz))
+			write_crc_array(&job->buf[crc_start - job->boffset], job->infile, crc_start);
+
+		job->pos = 0;
+	}
+
+	job->phase = JOB_DONE;
+	return 0;
+}
+
+static void job_drop(job_t *job)
+{
+	printf("\nflashing module id %d failed!\n\n", job->fl->module_id);
+	job->fl->failed = 1;
+	job->phase = JOB_DONE;
+}
+
+/* a failed transfer is repeated with a smaller block size */
+static int job_retry(job_t *job)
+{
+	flash_t *fl = job->fl;
+
+	/* programming errors are not fixed by smaller blocks */
+	if ((job->phase != JOB_WRITE) ||
+	    (job->sess.failed_in >= SESS_PROGRAM) ||
+	    (fl->xfer_size / 2 < MIN_XFER_SIZE))
+		return 0;
+
+	fl->xfer_size /= 2;
+	printf("reduce block size to %d for module id %d\n",
+	       fl->xfer_size, fl->module_id);
+
+	/* repeat this part */
+	job->pos -= job->len;
+	return 1;
+}
+
+/*
+ * Flash the modules of the jobs with their own images. The erase and
+ * program times of one module are used for the data transfers to the
+ * other modules. Returns the number of failed modules.
+ */
+int sched_run(canio_t *io, job_t *jobs, int count)
+{
+	sess_t *sess[MAX_MODULES];
+	int i, ret, active, failed = 0;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].phase = JOB_ERASE;
+		jobs[i].sector = 0;
+		sess_init(&jobs[i].sess, io, jobs[i].fl->module_id, jobs[i].fl->dry_run);
+		sess[i] = &jobs[i].sess;
+	}
+
+	do {
+		for (i = 0, active = 0; i < count; i++) {
+			if (jobs[i].phase == JOB_DONE)
+				continue;
+
+			active++;
+
+			if (sess_busy(&jobs[i].sess))
+				continue;
+
+			if ((jobs[i].sess.state == SESS_FAILED) && !job_retry(&jobs[i])) {
+				job_drop(&jobs[i]);
+				failed++;
+				continue;
+			}
+
+			if ((jobs[i].sess.state == SESS_DONE) && (jobs[i].sess.op == SESS_OP_WRITE))
+				work_block_written();
+
+			ret = job_next(&jobs[i]);
+			if (!ret)
+				printf("module id %d: done\n", jobs[i].fl->module_id);
+			else if (ret < 0) {
+				job_drop(&jobs[i]);
+				failed++;
+			}
+		}
+
+		sess_step(io, sess, count);
+
+	} while (active);
+
+	return failed;
+}
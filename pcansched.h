@@ -0,0 +1,62 @@
+/*
+ * pcansched.h - interleaved flashing of modules for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANSCHEDH__
+#define __PCANSCHEDH__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pcanio.h"
+#include "pcanfunc.h"
+#include "pcansess.h"
+
+/* max. known block size */
+#define JOB_BUFSZ 512
+
+/* phases of a flashing job */
+#define JOB_ERASE	0
+#define JOB_WRITE	1
+#define JOB_DONE	2
+
+/* flashing process of one module with its own image */
+typedef struct {
+	flash_t *fl;
+	FILE *infile;
+	int phase;
+	int sector;		/* next flash sector to be erased */
+	long foffset;		/* next block in the image */
+	long boffset;		/* current block in the image */
+	uint32_t blksz;
+	uint32_t pos;		/* written part of the current block */
+	uint32_t len;		/* length of the current transfer */
+	uint8_t buf[JOB_BUFSZ];
+	sess_t sess;
+} job_t;
+
+int sched_run(canio_t *io, job_t *jobs, int count);
+
+#endif
@@ -0,0 +1,833 @@
+/*
+ * pcansess.c - flash session state machine for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <linux/can.h>
+
+#include "pcanflash.h"
+#include "pcanfunc.h"
+#include "pcanhw.h"
+#include "pcanio.h"
+#include "pcannl.h"
+#include "pcansess.h"
+
+static const char *state_names[] = {
+	"idle",
+	"set address",
+	"set size",
+	"data burst",
+	"checksum",
+	"program",
+	"verify",
+	"erase",
+	"done",
+	"failed",
+};
+
+/* hardware types whose bootloader rejected the pipelined handshake */
+static uint8_t strict_hw[256];
+
+/* smoothed round trip time and its variation in us (0 = no sample) */
+typedef struct {
+	long srtt;
+	long rttvar;
+} rto_t;
+
+static rto_t rto_table[MAX_MODULES][SESS_RTO_CLASSES];
+
+static long ts_diff_us(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L +
+		(end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* number of SESS_RTO_UNIT the round trip of this command class scales with */
+static long rto_scale(int rto_class, uint32_t len)
+{
+	if ((rto_class < SESS_RTO_PROGRAM) || (len <= SESS_RTO_UNIT))
+		return 1;
+
+	return (len + SESS_RTO_UNIT - 1) / SESS_RTO_UNIT;
+}
+
+long sess_rto_us(uint8_t module_id, int rto_class, uint32_t len)
+{
+	rto_t *rto = &rto_table[module_id & MAX_MODULES_MASK][rto_class];
+	long scale = rto_scale(rto_class, len);
+	long rto_us, cmd_us;
+
+	if (!rto->srtt)
+		return SESS_RTO_INIT_US * scale;
+
+	rto_us = (rto->srtt + 4 * rto->rttvar) * scale;
+	if (rto_us < SESS_RTO_MIN_US)
+		rto_us = SESS_RTO_MIN_US;
+
+	/* never below the turnaround of a simple command */
+	if (rto_class != SESS_RTO_CMD) {
+		cmd_us = sess_rto_us(module_id, SESS_RTO_CMD, 0);
+		if (rto_us < cmd_us)
+			rto_us = cmd_us;
+	}
+
+	/* not longer than without any measurement */
+	if (rto_us > SESS_RTO_INIT_US * scale)
+		rto_us = SESS_RTO_INIT_US * scale;
+
+	return rto_us;
+}
+
+void sess_rto_sample(uint8_t module_id, int rto_class, uint32_t len, long rtt_us)
+{
+	rto_t *rto = &rto_table[module_id & MAX_MODULES_MASK][rto_class];
+	long delta;
+
+	rtt_us /= rto_scale(rto_class, len);
+	if (rtt_us < 1)
+		rtt_us = 1;
+
+	if (!rto->srtt) {
+		rto->srtt = rtt_us;
+		rto->rttvar = rtt_us / 2;
+		return;
+	}
+
+	delta = rto->srtt - rtt_us;
+	if (delta < 0)
+		delta = -delta;
+
+	rto->rttvar = (3 * rto->rttvar + delta) / 4;
+	rto->srtt = (7 * rto->srtt + rtt_us) / 8;
+}
+
+/* prepare the status request - it is sent by sess_step() */
+static void sess_request_status(sess_t *sess, struct can_frame *frame)
+{
+	init_set_cmd(frame);
+	frame->data[2] = sess->module_id;
+	frame->data[3] = CAN2FLASH_STATE_REQUEST;
+
+	sess->tx_pending = 0;
+	sess->err_frames = sess->io->err_frames;
+	clock_gettime(CLOCK_MONOTONIC, &sess->sent);
+
+	/* exponential backoff for repeated requests */
+	if (!sess->retries)
+		sess->timeout_us = sess_rto_us(sess->module_id, sess->rto_class,
+					       sess->rto_len);
+	else
+		sess->timeout_us *= 2;
+
+	sess->deadline = sess->sent;
+	sess->deadline.tv_sec += sess->timeout_us / 1000000;
+	sess->deadline.tv_nsec += (sess->timeout_us % 1000000) * 1000;
+	if (sess->deadline.tv_nsec >= 1000000000L) {
+		sess->deadline.tv_sec++;
+		sess->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/* the command of the new state and its status request are sent by
+ * sess_run() after draining the replies which are still in the socket
+ * from the previous commands
+ */
+static void sess_enter(sess_t *sess, int state)
+{
+	sess->state = state;
+	sess->retries = 0;
+	sess->replied = 0;
+	sess->tx_pending = SESS_TX_CMD;
+}
+
+/* send the command(s) of the current state */
+static void sess_send(sess_t *sess)
+{
+	sess->tx_pending = SESS_TX_STATUS;
+	sess->rto_class = SESS_RTO_CMD;
+	sess->rto_len = sess->len;
+
+	switch (sess->state) {
+
+	case SESS_SET_ADDR:
+		set_startaddress(sess->io, sess->module_id, sess->addr);
+
+		/* queue the block size and check both status bits at once */
+		if (sess->pipeline) {
+			set_blocksize(sess->io, sess->module_id, sess->len);
+			sess->state = SESS_SET_SIZE;
+		}
+		break;
+
+	case SESS_SET_SIZE:
+		set_blocksize(sess->io, sess->module_id, sess->len);
+		break;
+
+	case SESS_DATA:
+		/* the multicast data burst is sent by sess_run() */
+		if (!(sess->flags & SESS_MULTICAST))
+			canio_write_data(sess->io, sess->frames, sess->count);
+		sess->rto_class = SESS_RTO_DATA;
+
+		/* queue the checksum behind the data burst */
+		if (sess->pipeline) {
+			set_checksum(sess->io, sess->module_id, sess->csum);
+			sess->state = SESS_CHECKSUM;
+		}
+		break;
+
+	case SESS_CHECKSUM:
+		set_checksum(sess->io, sess->module_id, sess->csum);
+		break;
+
+	case SESS_PROGRAM:
+		start_programming(sess->io, sess->module_id);
+		sess->rto_class = SESS_RTO_PROGRAM;
+		break;
+
+	case SESS_VERIFY:
+		verify(sess->io, sess->module_id);
+		sess->rto_class = SESS_RTO_VERIFY;
+		break;
+
+	case SESS_ERASE:
+		erase_sector(sess->io, sess->module_id);
+		sess->rto_class = SESS_RTO_ERASE;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* tx drop counter of the interface at the start of the block transfer */
+static void sess_drop_snapshot(sess_t *sess)
+{
+	if (sess->block_retries)
+		sess->drops_valid = !nl_get_tx_dropped(sess->io->ifindex,
+						       &sess->tx_dropped);
+}
+
+/* the block has not been programmed when the program command got lost -
+ * which is only known from a status reply to the program step
+ */
+static int sess_unprogrammed(sess_t *sess)
+{
+	return (sess->state < SESS_PROGRAM) ||
+		((sess->state == SESS_PROGRAM) && sess->replied &&
+		 (sess->status == (SET_CHECKSUM_OK | SET_STARTADDR | SET_LENGTH | SET_CHECKSUM)));
+}
+
+/* repeat a block transfer which failed before programming the block */
+static void sess_abort(sess_t *sess)
+{
+	uint64_t dropped;
+
+	if ((sess->op == SESS_OP_WRITE) && sess_unprogrammed(sess) &&
+	    (sess->block_retries > 0)) {
+
+		/* tell lost frames on the interface from a checksum error */
+		if (sess->drops_valid &&
+		    !nl_get_tx_dropped(sess->io->ifindex, &dropped) &&
+		    (dropped != sess->tx_dropped))
+			printf("module id %d: %llu frames dropped by the interface",
+			       sess->module_id,
+			       (unsigned long long)(dropped - sess->tx_dropped));
+		else
+			printf("module id %d: no frames dropped by the interface",
+			       sess->module_id);
+
+		sess->block_retries--;
+		printf(" - repeat block at 0x%06X (%d retries left)\n",
+		       sess->addr, sess->block_retries);
+
+		sess->io->block_retries++;
+		sess_drop_snapshot(sess);
+		sess_enter(sess, SESS_SET_ADDR);
+		return;
+	}
+
+	sess->failed_in = (sess_unprogrammed(sess)) ? SESS_DATA : sess->state;
+	sess->state = SESS_FAILED;
+}
+
+static void sess_fail(sess_t *sess, const char *step)
+{
+	fprintf(stderr, "module id %d: %s - wrong status %02X!\n",
+		sess->module_id, step, sess->status);
+	sess_abort(sess);
+}
+
+/* the bootloader did not take the queued command (its status bit is
+ * missing): remember this for the hardware type and restart the sequence
+ * with a status request after each command.
+ */
+static int sess_fallback(sess_t *sess, uint8_t cmd_bit)
+{
+	if (!sess->pipeline || (sess->status & cmd_bit))
+		return 0;
+
+	printf("module id %d: pipelined handshake rejected (status %02X) - "
+	       "fall back to strict handshake for hardware type %d\n",
+	       sess->module_id, sess->status, sess->hw_type);
+
+	strict_hw[sess->hw_type] = 1;
+	sess->pipeline = 0;
+	sess_enter(sess, SESS_SET_ADDR);
+
+	return 1;
+}
+
+/* check the status reply of the current erase step */
+static void sess_erase_status(sess_t *sess)
+{
+	uint8_t status = sess->status;
+
+	switch (sess->state) {
+
+	case SESS_SET_ADDR:
+		if ((!sess->dry_run) && ((status & SET_STARTADDR) != SET_STARTADDR)) {
+			sess_fail(sess, "erase1");
+			break;
+		}
+
+		sess_enter(sess, SESS_SET_SIZE);
+		break;
+
+	case SESS_SET_SIZE:
+		if ((!sess->dry_run) &&
+		    ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH))) {
+			if (!sess_fallback(sess, SET_LENGTH))
+				sess_fail(sess, "erase2");
+			break;
+		}
+
+		if (sess->dry_run)
+			sess->state = SESS_DONE;
+		else
+			sess_enter(sess, SESS_ERASE);
+		break;
+
+	case SESS_ERASE:
+		if ((status & SET_ERASE_OK) != SET_ERASE_OK) {
+			sess_fail(sess, "erase3");
+			break;
+		}
+
+		sess->state = SESS_DONE;
+		break;
+	}
+}
+
+/* check the status reply of the current write step */
+static void sess_write_status(sess_t *sess)
+{
+	uint8_t status = sess->status;
+
+	switch (sess->state) {
+
+	case SESS_SET_ADDR:
+		if ((status & SET_STARTADDR) != (SET_STARTADDR)) {
+			sess_fail(sess, "flash1");
+			break;
+		}
+
+		sess_enter(sess, SESS_SET_SIZE);
+		break;
+
+	case SESS_SET_SIZE:
+		if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
+			if (!sess_fallback(sess, SET_LENGTH))
+				sess_fail(sess, "flash2");
+			break;
+		}
+
+		sess_enter(sess, SESS_DATA);
+		break;
+
+	case SESS_DATA:
+		if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
+			sess_fail(sess, "flash3");
+			break;
+		}
+
+		sess_enter(sess, SESS_CHECKSUM);
+		break;
+
+	case SESS_CHECKSUM:
+		if (status != (SET_CHECKSUM_OK | SET_STARTADDR | SET_LENGTH | SET_CHECKSUM)) {
+			if (!sess_fallback(sess, SET_CHECKSUM))
+				sess_fail(sess, "flash4");
+			break;
+		}
+
+		if (sess->dry_run)
+			sess->state = SESS_DONE;
+		else
+			sess_enter(sess, SESS_PROGRAM);
+		break;
+
+	case SESS_PROGRAM:
+		if (status != (SET_CHECKSUM_OK)) {
+			sess_fail(sess, "flash5");
+			break;
+		}
+
+		if (sess->flags & SESS_NO_VERIFY)
+			sess->state = SESS_DONE;
+		else
+			sess_enter(sess, SESS_VERIFY);
+		break;
+
+	case SESS_VERIFY:
+		if (status != (SET_CHECKSUM_OK | SET_VERIFY_OK)) {
+			sess_fail(sess, "flash6");
+			break;
+		}
+
+		sess->state = SESS_DONE;
+		break;
+	}
+}
+
+/* check the status reply of the current verify step */
+static void sess_verify_status(sess_t *sess)
+{
+	uint8_t status = sess->status;
+
+	switch (sess->state) {
+
+	case SESS_SET_ADDR:
+		if ((status & SET_STARTADDR) != (SET_STARTADDR)) {
+			sess_fail(sess, "verify1");
+			break;
+		}
+
+		sess_enter(sess, SESS_SET_SIZE);
+		break;
+
+	case SESS_SET_SIZE:
+		if ((status & (SET_STARTADDR | SET_LENGTH)) != (SET_STARTADDR | SET_LENGTH)) {
+			if (!sess_fallback(sess, SET_LENGTH))
+				sess_fail(sess, "verify2");
+			break;
+		}
+
+		sess_enter(sess, SESS_CHECKSUM);
+		break;
+
+	case SESS_CHECKSUM:
+		if ((status & SET_CHECKSUM) != (SET_CHECKSUM)) {
+			sess_fail(sess, "verify3");
+			break;
+		}
+
+		sess_enter(sess, SESS_VERIFY);
+		break;
+
+	case SESS_VERIFY:
+		if ((status & SET_VERIFY_OK) != (SET_VERIFY_OK)) {
+			if (sess->flags & SESS_PROBE) {
+				sess->failed_in = SESS_VERIFY;
+				sess->state = SESS_FAILED;
+			} else
+				sess_fail(sess, "verify4");
+			break;
+		}
+
+		sess->state = SESS_DONE;
+		break;
+	}
+}
+
+void sess_init(sess_t *sess, canio_t *io, uint8_t module_id, int dry_run)
+{
+	memset(sess, 0, sizeof(sess_t));
+
+	sess->io = io;
+	sess->module_id = module_id;
+	sess->dry_run = dry_run;
+	sess->state = SESS_IDLE;
+}
+
+void sess_set_flags(sess_t *sess, uint8_t hw_type, int flags)
+{
+	sess->hw_type = hw_type;
+	sess->flags = flags;
+
+	/* queue the commands of a block and check the status once per group */
+	sess->pipeline = (flags & SESS_PIPELINE) && !strict_hw[hw_type];
+}
+
+void sess_set_retries(sess_t *sess, int retries)
+{
+	sess->block_retries = retries;
+}
+
+void sess_erase(sess_t *sess, uint32_t addr, uint32_t len)
+{
+	sess->op = SESS_OP_ERASE;
+	sess->addr = addr;
+	sess->len = len;
+	sess->count = 0;
+
+	sess_enter(sess, SESS_SET_ADDR);
+}
+
+/* build the data frames of the block and start the write sequence */
+int sess_write(sess_t *sess, uint32_t addr, uint32_t len, uint8_t *buf,
+	       uint32_t alternating_xor_flip, uint8_t ftd_len)
+{
+	struct can_frame *frame;
+	int i, j, xor_flip;
+
+	sess->op = SESS_OP_WRITE;
+	sess->addr = addr;
+	sess->len = len;
+
+	for (i = 0, sess->csum = 0; i < len; i++)
+		sess->csum = (sess->csum + *(buf + i)) & 0xFFFFU;
+
+	xor_flip = 0;
+	sess->count = 0;
+
+	for (i = 0; i < len; i += ftd_len, xor_flip ^= 1) {
+
+		uint8_t flen = ftd_len;
+
+		if (sess->count >= MAX_BLOCK_FRAMES) {
+			fprintf(stderr, "block size %d too big for data len %d!\n",
+				len, ftd_len);
+			sess->state = SESS_FAILED;
+			return 1;
+		}
+
+		frame = &sess->frames[sess->count++];
+		memset(frame, 0, sizeof(struct can_frame));
+		frame->can_id = CAN_ID;
+		frame->can_dlc = 8;
+
+		/* prepare frame for DATA_LEN6 */
+		if (ftd_len == DATA_LEN6) {
+			frame->data[0] = 0x7F;
+			frame->data[1] = 0xFF;
+
+			/* last frame for DATA_LEN6 */
+			if (i + ftd_len >= len)
+				flen = len - i;
+		}
+
+		for (j = 0; j < flen; j++)
+			frame->data[j + (8 - ftd_len)] = *(buf + i + j);
+
+		if ((xor_flip) && (alternating_xor_flip)) {
+			for (j = 0; j < flen; j++)
+				frame->data[j + (8 - ftd_len)] ^= 0xFF;
+		}
+	}
+
+	sess_drop_snapshot(sess);
+	sess_enter(sess, SESS_SET_ADDR);
+
+	return 0;
+}
+
+/* verify a flash range that has been programmed without verification */
+void sess_verify(sess_t *sess, uint32_t addr, uint32_t len, uint16_t csum)
+{
+	sess->op = SESS_OP_VERIFY;
+	sess->addr = addr;
+	sess->len = len;
+	sess->csum = csum;
+	sess->count = 0;
+
+	sess_enter(sess, SESS_SET_ADDR);
+}
+
+int sess_busy(sess_t *sess)
+{
+	return (sess->state != SESS_IDLE) &&
+		(sess->state != SESS_DONE) &&
+		(sess->state != SESS_FAILED);
+}
+
+/* returns 1 when the frame is the status reply of this session */
+int sess_frame(sess_t *sess, struct can_frame *frame)
+{
+	struct timespec now;
+
+	if (!sess_busy(sess))
+		return 0;
+
+	if (!is_status_reply(frame, sess->module_id))
+		return 0;
+
+	/* late reply to a previous command of this session */
+	if (sess->tx_pending) {
+		sess->io->rx_stale++;
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	canio_stat_add(&sess->io->rtt_stat, ts_diff_us(&sess->sent, &now));
+
+	/* only unambiguous round trips update the estimation (Karn) */
+	if (!sess->retries)
+		sess_rto_sample(sess->module_id, sess->rto_class, sess->rto_len,
+				ts_diff_us(&sess->sent, &now));
+
+	sess->status = frame->data[5];
+	sess->replied = 1;
+
+	if (sess->op == SESS_OP_ERASE)
+		sess_erase_status(sess);
+	else if (sess->op == SESS_OP_VERIFY)
+		sess_verify_status(sess);
+	else
+		sess_write_status(sess);
+
+	return 1;
+}
+
+void sess_timer(sess_t *sess, struct timespec *now)
+{
+	if (!sess_busy(sess) || sess->tx_pending || (ts_diff_us(now, &sess->deadline) > 0))
+		return;
+
+	/* repeat the request with doubled timeout - and some more times
+	 * when the reply got lost by bus errors
+	 */
+	if ((sess->retries < SESS_RTO_RETRIES) ||
+	    ((sess->io->err_frames != sess->err_frames) &&
+	     (sess->retries < SESS_RTO_RETRIES + CANIO_ERR_RETRIES))) {
+		sess->retries++;
+		sess->io->rto_retries++;
+		sess->tx_pending = SESS_TX_STATUS;
+		return;
+	}
+
+	fprintf(stderr, "module id %d: timeout in %s state after %ld ms (%s)!\n",
+		sess->module_id, sess_state_name(sess), sess->timeout_us / 1000,
+		canio_state_name(sess->io));
+	sess_abort(sess);
+}
+
+const char *sess_state_name(sess_t *sess)
+{
+	return state_names[sess->state];
+}
+
+static void sess_dispatch(canio_t *io, sess_t **sess, int count,
+			  struct can_frame *frame)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (sess_frame(sess[i], frame))
+			return;
+	}
+
+	/* no session on this bus waits for this frame */
+	io->rx_unexpected++;
+}
+
+/* the data burst of a multicast group is sent once when all its
+ * sessions have set the start address and block size
+ */
+static sess_t *sess_multicast_burst(sess_t **sess, int count)
+{
+	sess_t *burst = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!sess_busy(sess[i]) || !(sess[i]->flags & SESS_MULTICAST))
+			continue;
+
+		if ((sess[i]->state != SESS_DATA) || (sess[i]->tx_pending != SESS_TX_CMD))
+			return NULL;
+
+		burst = sess[i];
+	}
+
+	return burst;
+}
+
+/* a write session holds the bus for its data from setting the start
+ * address until the checksum has been taken. An erase session sets the
+ * start address and size as well which lets the module take data frames
+ * until the erase command.
+ */
+static int sess_data_window(sess_t *sess)
+{
+	if (!sess_busy(sess) || (sess->op == SESS_OP_VERIFY))
+		return 0;
+
+	if (sess->state == SESS_SET_ADDR)
+		return sess->tx_pending != SESS_TX_CMD;
+
+	if (sess->op == SESS_OP_ERASE)
+		return (sess->state == SESS_SET_SIZE) ||
+			((sess->state == SESS_ERASE) && (sess->tx_pending == SESS_TX_CMD));
+
+	return (sess->state >= SESS_SET_SIZE) && (sess->state <= SESS_CHECKSUM);
+}
+
+/* the data frames carry no module id: a write or erase session only
+ * starts when no other session (except of its multicast group) waits
+ * for its data
+ */
+static int sess_blocked(sess_t **sess, int count, int index)
+{
+	sess_t *sp = sess[index];
+	int i;
+
+	if ((sp->op == SESS_OP_VERIFY) || (sp->state != SESS_SET_ADDR))
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if ((i == index) || !sess_data_window(sess[i]))
+			continue;
+
+		if (!(sp->flags & sess[i]->flags & SESS_MULTICAST))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* send the pending commands and status requests and wait for the next
+ * reply or timeout. Returns the number of sessions which are still busy.
+ */
+int sess_step(canio_t *io, sess_t **sess, int count)
+{
+	struct can_frame frame, req;
+	struct timespec now, *next;
+	sess_t *burst;
+	long wait_us;
+	int i, busy, linked, ret;
+
+	/* drop what is left from previous commands before sending
+	 * the next commands and again before the status requests as
+	 * a data burst gives late replies some time to show up
+	 */
+	while (canio_read(io, &frame, 0))
+		sess_dispatch(io, sess, count, &frame);
+
+	burst = sess_multicast_burst(sess, count);
+	if (burst)
+		canio_write_data(io, burst->frames, burst->count);
+
+	for (i = 0; i < count; i++) {
+		if (!sess_busy(sess[i]) || (sess[i]->tx_pending != SESS_TX_CMD))
+			continue;
+
+		/* wait for the other sessions of the multicast group */
+		if ((sess[i]->flags & SESS_MULTICAST) &&
+		    (sess[i]->state == SESS_DATA) && !burst)
+			continue;
+
+		/* wait for the data transfer of another module */
+		if (sess_blocked(sess, count, i))
+			continue;
+
+		sess_send(sess[i]);
+	}
+
+	while (canio_read(io, &frame, 0))
+		sess_dispatch(io, sess, count, &frame);
+
+	next = NULL;
+	linked = 0;
+	for (i = 0, busy = 0; i < count; i++) {
+		if (!sess_busy(sess[i]))
+			continue;
+
+		busy++;
+
+		if (sess[i]->tx_pending == SESS_TX_STATUS) {
+			/* -T uring links one status request to the read of the reply */
+			if ((io->backend == CANIO_URING) && !linked) {
+				sess_request_status(sess[i], &req);
+				linked = 1;
+			} else {
+				sess_request_status(sess[i], &frame);
+				canio_write(io, &frame, 1);
+			}
+		}
+
+		/* no request pending while waiting for a data burst */
+		if (sess[i]->tx_pending)
+			continue;
+
+		if (!next || (ts_diff_us(&sess[i]->deadline, next) > 0))
+			next = &sess[i]->deadline;
+	}
+
+	if (!next)
+		return busy;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait_us = ts_diff_us(&now, next);
+	if (wait_us < 0)
+		wait_us = 0;
+
+	if (linked)
+		ret = canio_exchange(io, &req, &frame, (wait_us + 999) / 1000);
+	else
+		ret = canio_read(io, &frame, (wait_us + 999) / 1000);
+
+	if (ret)
+		sess_dispatch(io, sess, count, &frame);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < count; i++)
+		sess_timer(sess[i], &now);
+
+	return busy;
+}
+
+/* feed received frames and timer expirations to the sessions on this
+ * CAN interface until all of them are done or failed. Returns the number
+ * of failed sessions.
+ */
+int sess_run(canio_t *io, sess_t **sess, int count)
+{
+	int i, failed;
+
+	while (sess_step(io, sess, count))
+		;
+
+	for (i = 0, failed = 0; i < count; i++) {
+		if (sess[i]->state == SESS_FAILED)
+			failed++;
+	}
+
+	return failed;
+}
@@ -0,0 +1,133 @@
+/*
+ * pcansess.h - flash session state machine for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+
+#ifndef __PCANSESSH__
+#define __PCANSESSH__
+
+#include <stdint.h>
+#include <time.h>
+#include <linux/can.h>
+
+#include "pcanio.h"
+
+/* max. known block size (512) transferred in DATA_LEN6 frames */
+#define MAX_BLOCK_FRAMES ((512 + DATA_LEN6 - 1) / DATA_LEN6)
+
+/*
+ * Retransmission timeout of the status requests per module and command
+ * class, estimated from the measured round trips like the TCP RTO
+ * (RFC 6298). Program, verify and erase times are estimated per
+ * SESS_RTO_UNIT bytes and scaled with the length of the flash range.
+ */
+#define SESS_RTO_INIT_US	3000000	/* no round trip measured yet */
+#define SESS_RTO_MIN_US		20000
+#define SESS_RTO_UNIT		(64 * 1024)
+#define SESS_RTO_RETRIES	3	/* status requests with doubled RTO */
+
+#define SESS_RTO_CMD		0
+#define SESS_RTO_DATA		1
+#define SESS_RTO_PROGRAM	2
+#define SESS_RTO_VERIFY		3
+#define SESS_RTO_ERASE		4
+#define SESS_RTO_CLASSES	5
+
+/* session operations */
+#define SESS_OP_ERASE	0
+#define SESS_OP_WRITE	1
+#define SESS_OP_VERIFY	2
+
+/* session flags */
+#define SESS_PIPELINE	(1 << 0) /* queue commands between status requests */
+#define SESS_NO_VERIFY	(1 << 1) /* blocks are verified per sector later */
+#define SESS_PROBE	(1 << 2) /* a mismatching verify is no error */
+#define SESS_MULTICAST	(1 << 3) /* one data burst for all sessions of the run */
+
+/* pending transmissions of a session */
+#define SESS_TX_CMD	1
+#define SESS_TX_STATUS	2
+
+/* session states */
+#define SESS_IDLE	0
+#define SESS_SET_ADDR	1
+#define SESS_SET_SIZE	2
+#define SESS_DATA	3
+#define SESS_CHECKSUM	4
+#define SESS_PROGRAM	5
+#define SESS_VERIFY	6
+#define SESS_ERASE	7
+#define SESS_DONE	8
+#define SESS_FAILED	9
+
+typedef struct {
+	canio_t *io;
+	uint8_t module_id;
+	int dry_run;
+	int flags;
+	int pipeline;
+	uint8_t hw_type;
+	int op;
+	int state;
+	uint32_t addr;
+	uint32_t len;
+	uint16_t csum;
+	int count;
+	struct can_frame frames[MAX_BLOCK_FRAMES];
+	/* pending status request */
+	int tx_pending;
+	int rto_class;
+	uint32_t rto_len;
+	long timeout_us;
+	int retries;
+	/* repeated block transfers */
+	int block_retries;
+	int drops_valid;
+	uint64_t tx_dropped;
+	int failed_in;
+	unsigned long err_frames;
+	struct timespec sent;
+	struct timespec deadline;
+	uint8_t status;
+	int replied;	/* status reply received in the current state */
+} sess_t;
+
+void sess_init(sess_t *sess, canio_t *io, uint8_t module_id, int dry_run);
+void sess_set_flags(sess_t *sess, uint8_t hw_type, int flags);
+void sess_set_retries(sess_t *sess, int retries);
+void sess_erase(sess_t *sess, uint32_t addr, uint32_t len);
+int sess_write(sess_t *sess, uint32_t addr, uint32_t len, uint8_t *buf,
+	       uint32_t alternating_xor_flip, uint8_t ftd_len);
+void sess_verify(sess_t *sess, uint32_t addr, uint32_t len, uint16_t csum);
+int sess_busy(sess_t *sess);
+int sess_frame(sess_t *sess, struct can_frame *frame);
+void sess_timer(sess_t *sess, struct timespec *now);
+int sess_step(canio_t *io, sess_t **sess, int count);
+int sess_run(canio_t *io, sess_t **sess, int count);
+const char *sess_state_name(sess_t *sess);
+long sess_rto_us(uint8_t module_id, int rto_class, uint32_t len);
+void sess_rto_sample(uint8_t module_id, int rto_class, uint32_t len, long rtt_us);
+
+#endif
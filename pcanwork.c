@@ -0,0 +1,297 @@
+/*
+ * pcanwork.c - worker processes per CAN interface for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/wait.h>
+
+#include "pcanwork.h"
+
+/* progress pipe of a worker process (-1 = no worker) */
+static int work_progress_fd = -1;
+
+static long work_ms(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Fork a worker process for each CAN interface. The output of a worker
+ * goes to a pipe which is collected by work_wait(). The written blocks
+ * are reported through a second pipe. Returns the index of the interface
+ * in the worker and -1 in the parent process.
+ */
+int work_start(work_t *work, char **ifname, int count)
+{
+	int pfd[2], prfd[2];
+	int i, j, null;
+
+	/* flush before the stdio buffers are duplicated */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < count; i++) {
+		memset(&work[i], 0, sizeof(work_t));
+		work[i].ifname = ifname[i];
+
+		if (pipe(pfd) || pipe(prfd)) {
+			perror("pipe");
+			exit(1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &work[i].start);
+
+		work[i].pid = fork();
+		if (work[i].pid < 0) {
+			perror("fork");
+			exit(1);
+		}
+
+		if (!work[i].pid) {
+			/* the pipes of the other workers belong to the parent */
+			for (j = 0; j < i; j++) {
+				close(work[j].fd);
+				close(work[j].progress_fd);
+			}
+			close(pfd[0]);
+			close(prfd[0]);
+			work_progress_fd = prfd[1];
+
+			/* no questions can be answered by a worker */
+			null = open("/dev/null", O_RDONLY);
+			if ((null < 0) || (dup2(null, STDIN_FILENO) < 0) ||
+			    (dup2(pfd[1], STDOUT_FILENO) < 0) ||
+			    (dup2(pfd[1], STDERR_FILENO) < 0)) {
+				perror("worker output");
+				exit(1);
+			}
+			close(null);
+			close(pfd[1]);
+
+			/* keep the order of stdout and stderr lines */
+			setvbuf(stdout, NULL, _IOLBF, 0);
+
+			return i;
+		}
+
+		close(pfd[1]);
+		close(prfd[1]);
+		work[i].fd = pfd[0];
+		work[i].progress_fd = prfd[0];
+	}
+
+	return -1;
+}
+
+/* the file offset of an inherited file is shared with the other workers */
+FILE *work_reopen(FILE *fp)
+{
+	char path[32];
+	FILE *nfp;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(fp));
+
+	nfp = fopen(path, "r");
+	if (!nfp) {
+		perror("reopen infile");
+		exit(1);
+	}
+
+	fclose(fp);
+	return nfp;
+}
+
+/* report a completely written block to the parent process */
+void work_block_written(void)
+{
+	char c = 0;
+
+	if ((work_progress_fd >= 0) && (write(work_progress_fd, &c, 1) != 1)) {
+		perror("write progress");
+		work_progress_fd = -1;
+	}
+}
+
+/* count the written blocks - returns 0 when the worker closed the pipe */
+static int work_progress(work_t *work)
+{
+	char buf[256];
+	ssize_t ret;
+
+	ret = read(work->progress_fd, buf, sizeof(buf));
+	if (ret < 0) {
+		perror("read worker progress");
+		exit(1);
+	}
+
+	work->blocks += ret;
+
+	return ret;
+}
+
+static int work_read(work_t *work)
+{
+	ssize_t ret;
+
+	if (work->size - work->len < BUFSIZ) {
+		work->size += 16 * BUFSIZ;
+		work->out = realloc(work->out, work->size);
+		if (!work->out) {
+			perror("worker output");
+			exit(1);
+		}
+	}
+
+	ret = read(work->fd, work->out + work->len, work->size - work->len);
+	if (ret < 0) {
+		perror("read worker output");
+		exit(1);
+	}
+
+	work->len += ret;
+
+	return ret;
+}
+
+static void work_print_progress(work_t *work, int count)
+{
+	int i;
+
+	printf("\rwritten blocks:");
+	for (i = 0; i < count; i++)
+		printf(" %s %lu%s", work[i].ifname, work[i].blocks,
+		       (work[i].fd < 0) ? (work[i].status ? "(failed)" : "(done)") : "");
+	fflush(stdout);
+}
+
+/*
+ * Collect the output of the workers until all of them have finished and
+ * print it per CAN interface followed by a summary. On a terminal the
+ * written blocks of all workers are shown in one progress line.
+ * Returns the number of failed workers.
+ */
+int work_wait(work_t *work, int count)
+{
+	struct pollfd pfd[2 * MAX_WORKERS];
+	struct timespec now, shown;
+	int tty = isatty(STDOUT_FILENO);
+	int i, n, running, status, failed;
+
+	if ((count < 1) || (count > MAX_WORKERS))
+		return count;
+
+	clock_gettime(CLOCK_MONOTONIC, &shown);
+
+	for (running = count; running; ) {
+
+		for (i = 0, n = 0; i < count; i++) {
+			pfd[i].fd = work[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+			pfd[count + i].fd = work[i].progress_fd;
+			pfd[count + i].events = POLLIN;
+			pfd[count + i].revents = 0;
+		}
+
+		if (poll(pfd, 2 * count, WORK_PROGRESS_MS) < 0) {
+			perror("poll");
+			exit(1);
+		}
+
+		for (i = 0; i < count; i++) {
+			if (pfd[count + i].revents && !work_progress(&work[i])) {
+				close(work[i].progress_fd);
+				work[i].progress_fd = -1;
+			}
+
+			if (!pfd[i].revents || work_read(&work[i]))
+				continue;
+
+			/* end of output - the worker has finished */
+			close(work[i].fd);
+			work[i].fd = -1;
+			running--;
+			n++;
+
+			/* blocks reported before the exit */
+			if (work[i].progress_fd >= 0) {
+				while (work_progress(&work[i]))
+					;
+				close(work[i].progress_fd);
+				work[i].progress_fd = -1;
+			}
+
+			if (waitpid(work[i].pid, &status, 0) < 0) {
+				perror("waitpid");
+				exit(1);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &work[i].end);
+
+			if (WIFEXITED(status))
+				work[i].status = WEXITSTATUS(status);
+			else
+				work[i].status = -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (tty && (n || (work_ms(&shown, &now) >= WORK_PROGRESS_MS))) {
+			work_print_progress(work, count);
+			shown = now;
+		}
+	}
+
+	if (tty)
+		printf("\n");
+
+	for (i = 0; i < count; i++) {
+		printf("\n=== %s ===\n", work[i].ifname);
+		fwrite(work[i].out, 1, work[i].len, stdout);
+		free(work[i].out);
+	}
+
+	printf("\nsummary:\n\n");
+	for (i = 0, failed = 0; i < count; i++) {
+		printf("%s: ", work[i].ifname);
+		if (!work[i].status)
+			printf("flashed");
+		else {
+			printf("failed");
+			failed++;
+		}
+		printf(" in %ld ms (%lu written blocks)\n",
+		       work_ms(&work[i].start, &work[i].end), work[i].blocks);
+	}
+
+	printf("\nflashed %d of %d interfaces.\n\n", count - failed, count);
+
+	return failed;
+}
@@ -0,0 +1,59 @@
+/*
+ * pcanwork.h - worker processes per CAN interface for pcanflash
+ *
+ * Copyright (C) 2021  PEAK System-Technik GmbH
+ *
+ * linux@peak-system.com
+ * www.peak-system.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Maintainer(s): Stephane Grosjean (s.grosjean@peak-system.com)
+ *
+ */
+
+#ifndef __PCANWORKH__
+#define __PCANWORKH__
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define MAX_WORKERS 32
+
+/* progress update interval on a terminal */
+#define WORK_PROGRESS_MS 200
+
+/* flashing process of one CAN interface */
+typedef struct {
+	char *ifname;
+	pid_t pid;
+	int fd;			/* stdout and stderr of the worker */
+	int progress_fd;	/* one byte per written block */
+	char *out;		/* collected output */
+	size_t len;
+	size_t size;
+	unsigned long blocks;	/* written blocks */
+	int status;
+	struct timespec start;
+	struct timespec end;
+} work_t;
+
+int work_start(work_t *work, char **ifname, int count);
+FILE *work_reopen(FILE *fp);
+void work_block_written(void);
+int work_wait(work_t *work, int count);
+
+#endif